@@ -47,6 +47,15 @@ authorization from the copyright holders.
 #include "XeTeX_ext.h"
 
 #include <string.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+#include <algorithm>
+#include <map>
 #include FT_GLYPH_H
 #include FT_ADVANCES_H
 
@@ -65,6 +74,7 @@ XeTeXFontInst::XeTeXFontInst(const char* pathname, int index, float pointSize, i
     , m_vertical(false)
     , m_filename(NULL)
     , m_index(0)
+    , m_face(NULL)
     , m_ftFace(0)
     , m_hbFont(NULL)
 {
@@ -74,27 +84,70 @@ XeTeXFontInst::XeTeXFontInst(const char* pathname, int index, float pointSize, i
 
 XeTeXFontInst::~XeTeXFontInst()
 {
-    if (m_ftFace != 0) {
-        FT_Done_Face(m_ftFace);
+    hb_font_destroy(m_hbFont);
+    if (m_face != NULL) {
+        m_face->release();
+        m_face = NULL;
         m_ftFace = 0;
     }
-    hb_font_destroy(m_hbFont);
     delete[] m_filename;
 }
 
+/* FreeType lock
+
+   FreeType 2.5 does not let two threads use faces of the same FT_Library at
+   once, so all the faces opened with gFreeTypeLibrary share one lock; only
+   a face with a library of its own (a preloaded one) has its own lock. */
+
+static bool sThreaded = false;
+#ifndef WIN32
+static pthread_mutex_t sSharedLibraryMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void
+FreeTypeLock::setThreaded(bool threaded)
+{
+    // only called by the main thread while no worker is shaping
+    sThreaded = threaded;
+}
+
+FreeTypeLock::FreeTypeLock(XeTeXFontFace* face)
+    : m_face(sThreaded ? face : NULL)
+{
+#ifndef WIN32
+    if (m_face != NULL)
+        pthread_mutex_lock(m_face->m_ftLibrary != NULL ? &m_face->m_mutex : &sSharedLibraryMutex);
+#endif
+}
+
+FreeTypeLock::~FreeTypeLock()
+{
+#ifndef WIN32
+    if (m_face != NULL)
+        pthread_mutex_unlock(m_face->m_ftLibrary != NULL ? &m_face->m_mutex : &sSharedLibraryMutex);
+#endif
+}
+
 /* HarfBuzz font functions */
 
+// Before a batch is shaped on worker threads, the cmap and advances of its
+// faces are read in full (see layoutCharsBatch); while the workers run those
+// tables are only read, never changed, so lookups need no lock, and a miss
+// asks FreeType (under the lock) without caching the answer.
+
 static hb_bool_t
 _get_glyph(hb_font_t*, void *font_data, hb_codepoint_t ch, hb_codepoint_t vs, hb_codepoint_t *gid, void*)
 {
-    FT_Face face = (FT_Face) font_data;
+    XeTeXFontFace* face = (XeTeXFontFace*) font_data;
     *gid = 0;
 
-    if (vs)
-        *gid = FT_Face_GetCharVariantIndex (face, ch, vs);
+    if (vs) {
+        FreeTypeLock lock(face);
+        *gid = FT_Face_GetCharVariantIndex (face->getFTFace(), ch, vs);
+    }
 
     if (*gid == 0)
-        *gid = FT_Get_Char_Index (face, ch);
+        *gid = face->mapCharToGlyph(ch);
 
     return *gid != 0;
 }
@@ -125,13 +178,13 @@ _get_glyph_advance(FT_Face face, FT_UInt gid, bool vertical)
 static hb_position_t
 _get_glyph_h_advance(hb_font_t*, void *font_data, hb_codepoint_t gid, void*)
 {
-    return _get_glyph_advance((FT_Face) font_data, gid, false);
+    return ((XeTeXFontFace*) font_data)->getGlyphAdvance(gid, false);
 }
 
 static hb_position_t
 _get_glyph_v_advance(hb_font_t*, void *font_data, hb_codepoint_t gid, void*)
 {
-    return _get_glyph_advance((FT_Face) font_data, gid, true);
+    return ((XeTeXFontFace*) font_data)->getGlyphAdvance(gid, true);
 }
 
 static hb_bool_t
@@ -153,7 +206,7 @@ _get_glyph_v_origin(hb_font_t*, void *font_data, hb_codepoint_t gid, hb_position
     // Reconsider this (e.g. using BASE table) when we get around overhauling
     // the text directionality model and implementing real vertical typesetting.
 
-    FT_Face face = (FT_Face) font_data;
+    FT_Face face = ((XeTeXFontFace*) font_data)->getFTFace();
     FT_Error error;
 
     error = FT_Load_Glyph (face, gid, FT_LOAD_NO_SCALE);
@@ -168,7 +221,8 @@ _get_glyph_v_origin(hb_font_t*, void *font_data, hb_codepoint_t gid, hb_position
 static hb_position_t
 _get_glyph_h_kerning(hb_font_t*, void *font_data, hb_codepoint_t gid1, hb_codepoint_t gid2, void*)
 {
-    FT_Face face = (FT_Face) font_data;
+    FreeTypeLock lock((XeTeXFontFace*) font_data);
+    FT_Face face = ((XeTeXFontFace*) font_data)->getFTFace();
     FT_Error error;
     FT_Vector kerning;
     hb_position_t ret;
@@ -191,24 +245,14 @@ _get_glyph_v_kerning(hb_font_t*, void *font_data, hb_codepoint_t gid1, hb_codepo
 static hb_bool_t
 _get_glyph_extents(hb_font_t*, void *font_data, hb_codepoint_t gid, hb_glyph_extents_t *extents, void*)
 {
-    FT_Face face = (FT_Face) font_data;
-    FT_Error error;
-
-    error = FT_Load_Glyph (face, gid, FT_LOAD_NO_SCALE);
-    if (!error) {
-        extents->x_bearing = face->glyph->metrics.horiBearingX;
-        extents->y_bearing = face->glyph->metrics.horiBearingY;
-        extents->width  =  face->glyph->metrics.width;
-        extents->height = -face->glyph->metrics.height;
-    }
-
-    return !error;
+    return ((XeTeXFontFace*) font_data)->getGlyphExtents(gid, extents);
 }
 
 static hb_bool_t
 _get_glyph_contour_point(hb_font_t*, void *font_data, hb_codepoint_t gid, unsigned int point_index, hb_position_t *x, hb_position_t *y, void*)
 {
-    FT_Face face = (FT_Face) font_data;
+    FreeTypeLock lock((XeTeXFontFace*) font_data);
+    FT_Face face = ((XeTeXFontFace*) font_data)->getFTFace();
     FT_Error error;
     bool ret = false;
 
@@ -229,7 +273,8 @@ _get_glyph_contour_point(hb_font_t*, void *font_data, hb_codepoint_t gid, unsign
 static hb_bool_t
 _get_glyph_name(hb_font_t *, void *font_data, hb_codepoint_t gid, char *name, unsigned int size, void *)
 {
-    FT_Face face = (FT_Face) font_data;
+    FreeTypeLock lock((XeTeXFontFace*) font_data);
+    FT_Face face = ((XeTeXFontFace*) font_data)->getFTFace();
     bool ret = false;
 
     ret = !FT_Get_Glyph_Name (face, gid, name, size);
@@ -261,7 +306,8 @@ _get_font_funcs(void)
 static hb_blob_t *
 _get_table(hb_face_t *, hb_tag_t tag, void *user_data)
 {
-    FT_Face face = (FT_Face) user_data;
+    FreeTypeLock lock((XeTeXFontFace*) user_data);
+    FT_Face face = ((XeTeXFontFace*) user_data)->getFTFace();
     FT_ULong length = 0;
     FT_Byte *table;
     FT_Error error;
@@ -283,13 +329,354 @@ _get_table(hb_face_t *, hb_tag_t tag, void *user_data)
     return blob;
 }
 
+/* Setting xetex_mmap_fonts to true in texmf.cnf or the environment has font
+   files memory-mapped where possible, so that FreeType and HarfBuzz both read
+   straight from the (shared) page cache rather than each keeping private
+   copies of the tables. It is off by default, as a font file that is cut
+   short or replaced while it is mapped then kills the run with SIGBUS,
+   instead of making FreeType report an error. (Preloaded fonts are always
+   mapped.) */
+static bool
+mmapFonts()
+{
+    static int use_mmap = -1;
+    if (use_mmap < 0) {
+        char* v = kpse_var_value("xetex_mmap_fonts");
+        use_mmap = v && (*v == 't' || *v == 'y' || *v == '1');
+        free(v);
+    }
+    return use_mmap;
+}
+
+#ifndef WIN32
+struct MappedFile {
+    void* data;
+    size_t length;
+};
+
+static void
+_unmap_file(void* user_data)
+{
+    MappedFile* file = (MappedFile*) user_data;
+    munmap(file->data, file->length);
+    delete file;
+}
+#endif
+
+static hb_blob_t*
+_map_font_file(const char* pathname)
+{
+#ifndef WIN32
+    struct stat st;
+    int fd = open(pathname, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > (off_t) UINT_MAX) {
+        close(fd);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    MappedFile* file = new MappedFile;
+    file->data = data;
+    file->length = st.st_size;
+    return hb_blob_create((const char*) data, st.st_size, HB_MEMORY_MODE_READONLY, file, _unmap_file);
+#else
+    return NULL;
+#endif
+}
+
+/* HarfBuzz can only find the tables itself in plain sfnt files and collections,
+   not e.g. in WOFF files, which FreeType has to unpack for us. */
+static bool
+_is_plain_sfnt(hb_blob_t* blob)
+{
+    unsigned int length;
+    const unsigned char* data = (const unsigned char*) hb_blob_get_data(blob, &length);
+    if (length < 4)
+        return false;
+
+    hb_tag_t tag = HB_TAG(data[0], data[1], data[2], data[3]);
+    return tag == 0x00010000 || tag == HB_TAG('O','T','T','O') ||
+           tag == HB_TAG('t','r','u','e') || tag == HB_TAG('t','t','c','f');
+}
+
+/* Face pool */
+
+#define CHAR_PAGE_COUNT (0x110000 >> 8) // pages of 256 character codes in XeTeXFontFace's cmap
+
+typedef std::pair<std::string,int> FacePoolKey;
+static std::map<FacePoolKey,XeTeXFontFace*> sFacePool;
+
+/* Font preloading
+
+   With xetex_preload_fonts set in texmf.cnf or the environment, each run
+   writes the font files it opened to <jobname>.fonts, and the next run starts
+   opening those files on background threads as soon as it knows the job name:
+   each is mapped into memory, read through once (so that its pages are in the
+   cache) and opened with a FreeType library of its own, so that acquire() can
+   just take the face when the font is loaded. */
+
+struct PreloadedFace {
+    std::string pathname;
+    int         index;
+    FT_Library  library;
+    FT_Face     ftFace;
+    hb_blob_t*  fileBlob;
+    bool        done;
+};
+
+#define MAX_PRELOAD_THREADS 4
+
+static std::vector<PreloadedFace*> sPreloads;
+static std::map<FacePoolKey,PreloadedFace*> sPreloadIndex;
+static size_t sNextPreload = 0;
+static int sPreloadThreads = 0; // workers still running
+static long sPreloadsUsed = 0;
+#ifndef WIN32
+static pthread_mutex_t sPreloadMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sPreloadDone = PTHREAD_COND_INITIALIZER;
+#endif
+
+static std::string sFaceListPath; // where to write the list of fonts used, if anywhere
+static std::vector<FacePoolKey> sFacesUsed;
+
+static bool
+preloadFonts()
+{
+    static int preload = -1;
+    if (preload < 0) {
+        char* v = kpse_var_value("xetex_preload_fonts");
+        preload = v && (*v == 't' || *v == 'y' || *v == '1');
+        free(v);
+    }
+    return preload;
+}
+
+#ifndef WIN32
+static void
+_preload_face(PreloadedFace* face)
+{
+    face->fileBlob = _map_font_file(face->pathname.c_str());
+    if (face->fileBlob == NULL)
+        return;
+
+    unsigned int length;
+    const char* data = hb_blob_get_data(face->fileBlob, &length);
+    volatile char sum = 0;
+    for (unsigned int offset = 0; offset < length; offset += 4096)
+        sum += data[offset];
+
+    if (FT_Init_FreeType(&face->library) != 0) {
+        face->library = NULL;
+        return;
+    }
+    if (FT_New_Memory_Face(face->library, (const FT_Byte*) data, length, face->index, &face->ftFace) != 0) {
+        face->ftFace = NULL;
+        return;
+    }
+}
+
+static void*
+_preload_worker(void*)
+{
+    while (1) {
+        pthread_mutex_lock(&sPreloadMutex);
+        if (sNextPreload == sPreloads.size()) {
+            --sPreloadThreads;
+            pthread_cond_broadcast(&sPreloadDone);
+            pthread_mutex_unlock(&sPreloadMutex);
+            return NULL;
+        }
+        PreloadedFace* face = sPreloads[sNextPreload++];
+        pthread_mutex_unlock(&sPreloadMutex);
+
+        _preload_face(face);
+
+        pthread_mutex_lock(&sPreloadMutex);
+        face->done = true;
+        pthread_cond_broadcast(&sPreloadDone);
+        pthread_mutex_unlock(&sPreloadMutex);
+    }
+}
+#endif
+
+// lets the workers finish the faces they are opening but start no more, and
+// waits for them: this must happen before exit() destroys sPreloads
+static void
+_stop_preloading()
+{
+#ifndef WIN32
+    pthread_mutex_lock(&sPreloadMutex);
+    sNextPreload = sPreloads.size();
+    while (sPreloadThreads > 0)
+        pthread_cond_wait(&sPreloadDone, &sPreloadMutex);
+    pthread_mutex_unlock(&sPreloadMutex);
+#endif
+}
+
 void
-XeTeXFontInst::initialize(const char* pathname, int index, int &status)
+XeTeXFontFace::startPreloading(const char* faceListPath)
+{
+    if (!preloadFonts() || !sFaceListPath.empty())
+        return;
+    sFaceListPath = faceListPath;
+
+#ifndef WIN32
+    FILE* f = open_font_list_file(faceListPath, 0);
+    if (f == NULL)
+        return;
+    char line[4096];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        // each line is the face index, a tab and the file name
+        char* tab = strchr(line, '\t');
+        char* end = strchr(line, '\n');
+        if (tab == NULL || end == NULL || end < tab)
+            continue;
+        *end = 0;
+        FacePoolKey key(tab + 1, atoi(line));
+        if (sPreloadIndex.find(key) != sPreloadIndex.end() || sFacePool.find(key) != sFacePool.end())
+            continue;
+        // the list may have been written by anything that can write to the
+        // output directory, so each file must be one we may read anyway
+        if (!kpse_in_name_ok(key.first.c_str()))
+            continue;
+        PreloadedFace* face = new PreloadedFace;
+        face->pathname = key.first;
+        face->index = key.second;
+        face->library = NULL;
+        face->ftFace = NULL;
+        face->fileBlob = NULL;
+        face->done = false;
+        sPreloads.push_back(face);
+        sPreloadIndex[key] = face;
+    }
+    fclose(f);
+
+    size_t threads = std::min(sPreloads.size(), (size_t) MAX_PRELOAD_THREADS);
+    size_t started = 0;
+    if (threads > 0)
+        atexit(_stop_preloading); // also when the job ends with a fatal error
+    for (size_t i = 0; i < threads; ++i) {
+        pthread_t thread;
+        pthread_mutex_lock(&sPreloadMutex);
+        bool created = pthread_create(&thread, NULL, _preload_worker, NULL) == 0;
+        if (created)
+            ++sPreloadThreads;
+        pthread_mutex_unlock(&sPreloadMutex);
+        if (!created)
+            break;
+        pthread_detach(thread);
+        ++started;
+    }
+    if (started == 0) {
+        // then nothing will be preloaded after all
+        for (size_t i = 0; i < sPreloads.size(); ++i)
+            sPreloads[i]->done = true;
+    }
+#endif
+}
+
+// returns the preloaded face, if there is one, waiting for it if necessary
+static PreloadedFace*
+_take_preloaded_face(const char* pathname, int index)
+{
+#ifndef WIN32
+    std::map<FacePoolKey,PreloadedFace*>::iterator i = sPreloadIndex.find(FacePoolKey(pathname, index));
+    if (i == sPreloadIndex.end())
+        return NULL;
+    PreloadedFace* face = i->second;
+    sPreloadIndex.erase(i);
+
+    pthread_mutex_lock(&sPreloadMutex);
+    while (!face->done)
+        pthread_cond_wait(&sPreloadDone, &sPreloadMutex);
+    pthread_mutex_unlock(&sPreloadMutex);
+
+    if (face->ftFace == NULL) {
+        if (face->library != NULL)
+            FT_Done_FreeType(face->library);
+        hb_blob_destroy(face->fileBlob);
+        face->library = NULL;
+        face->fileBlob = NULL;
+        return NULL;
+    }
+    ++sPreloadsUsed;
+    return face;
+#else
+    return NULL;
+#endif
+}
+
+void
+XeTeXFontFace::writeFaceList()
+{
+    _stop_preloading();
+
+    // no font will be loaded now, so let go of the faces nobody asked for
+    for (std::map<FacePoolKey,PreloadedFace*>::iterator i = sPreloadIndex.begin(); i != sPreloadIndex.end(); ++i) {
+        PreloadedFace* face = i->second;
+        if (face->ftFace != NULL)
+            FT_Done_Face(face->ftFace);
+        if (face->library != NULL)
+            FT_Done_FreeType(face->library);
+        hb_blob_destroy(face->fileBlob);
+        face->ftFace = NULL;
+        face->library = NULL;
+        face->fileBlob = NULL;
+    }
+    sPreloadIndex.clear();
+
+    if (sFaceListPath.empty())
+        return;
+
+    FILE* f = open_font_list_file(sFaceListPath.c_str(), 1);
+    if (f == NULL)
+        return;
+    for (std::vector<FacePoolKey>::const_iterator i = sFacesUsed.begin(); i != sFacesUsed.end(); ++i)
+        fprintf(f, "%d\t%s\n", i->second, i->first.c_str());
+    fclose(f);
+    sFaceListPath.clear();
+}
+
+void
+XeTeXFontFace::getPreloadStats(long* preloaded, long* used)
+{
+    *preloaded = sPreloads.size();
+    *used = sPreloadsUsed;
+}
+
+/* Advances are normally looked up glyph by glyph as HarfBuzz asks for them;
+   setting xetex_preload_advances in texmf.cnf or the environment reads the
+   whole hmtx (or vmtx) table when the font is loaded instead. */
+static bool
+preloadAdvances()
+{
+    static int preload = -1;
+    if (preload < 0) {
+        char* v = kpse_var_value("xetex_preload_advances");
+        preload = v && (*v == 't' || *v == 'y' || *v == '1');
+        free(v);
+    }
+    return preload;
+}
+
+XeTeXFontFace*
+XeTeXFontFace::acquire(const char* pathname, int index)
 {
-    TT_Postscript *postTable;
-    TT_OS2* os2Table;
     FT_Error error;
-    hb_face_t *hbFace;
+    FT_Face ftFace;
+
+    std::map<FacePoolKey,XeTeXFontFace*>::iterator i = sFacePool.find(FacePoolKey(pathname, index));
+    if (i != sFacePool.end()) {
+        i->second->m_refCount++;
+        return i->second;
+    }
 
     if (!gFreeTypeLibrary) {
         error = FT_Init_FreeType(&gFreeTypeLibrary);
@@ -299,19 +686,43 @@ XeTeXFontInst::initialize(const char* pathname, int index, int &status)
         }
     }
 
-    error = FT_New_Face(gFreeTypeLibrary, pathname, index, &m_ftFace);
-    if (error) {
-        status = 1;
-        return;
+    hb_blob_t* fileBlob = NULL;
+    FT_Library library = NULL;
+    PreloadedFace* preloaded = _take_preloaded_face(pathname, index);
+    if (preloaded != NULL) {
+        library = preloaded->library;
+        ftFace = preloaded->ftFace;
+        fileBlob = preloaded->fileBlob;
+    } else if (mmapFonts())
+        fileBlob = _map_font_file(pathname);
+
+    if (fileBlob != NULL && preloaded == NULL) {
+        unsigned int length;
+        const char* data = hb_blob_get_data(fileBlob, &length);
+        error = FT_New_Memory_Face(gFreeTypeLibrary, (const FT_Byte*) data, length, index, &ftFace);
+        if (error) {
+            // let FreeType have another go at it the usual way
+            hb_blob_destroy(fileBlob);
+            fileBlob = NULL;
+        }
     }
 
-    if (!FT_IS_SCALABLE(m_ftFace)) {
-        status = 1;
-        return;
+    if (fileBlob == NULL) {
+        error = FT_New_Face(gFreeTypeLibrary, pathname, index, &ftFace);
+        if (error)
+            return NULL;
+    }
+
+    if (!FT_IS_SCALABLE(ftFace)) {
+        FT_Done_Face(ftFace);
+        if (library != NULL)
+            FT_Done_FreeType(library);
+        hb_blob_destroy(fileBlob);
+        return NULL;
     }
 
     /* for non-sfnt-packaged fonts (presumably Type 1), see if there is an AFM file we can attach */
-    if (index == 0 && !FT_IS_SFNT(m_ftFace)) {
+    if (index == 0 && !FT_IS_SFNT(ftFace)) {
         char* afm = xstrdup (xbasename (pathname));
         char* p = strrchr (afm, '.');
         if (p != NULL && strlen(p) == 4 && tolower(*(p+1)) == 'p' &&
@@ -320,11 +731,128 @@ XeTeXFontInst::initialize(const char* pathname, int index, int &status)
         char *fullafm = kpse_find_file (afm, kpse_afm_format, 0);
         free (afm);
         if (fullafm) {
-            FT_Attach_File(m_ftFace, fullafm);
+            FT_Attach_File(ftFace, fullafm);
             free (fullafm);
         }
     }
 
+    XeTeXFontFace* face = new XeTeXFontFace(pathname, index, ftFace, fileBlob);
+    face->m_ftLibrary = library;
+    sFacePool[FacePoolKey(pathname, index)] = face;
+    if (!sFaceListPath.empty())
+        sFacesUsed.push_back(FacePoolKey(pathname, index));
+
+    if (preloadAdvances())
+        face->loadAdvances(false);
+
+    return face;
+}
+
+/* The face most recently kept stays in the pool even when no font is using
+   it, so that (for instance) asking for a font file's design size and then
+   loading the font at the right size only opens the file once. */
+static XeTeXFontFace* sKeptFace = NULL;
+
+void
+XeTeXFontFace::keep()
+{
+    if (sKeptFace != this) {
+        m_refCount++;
+        if (sKeptFace != NULL)
+            sKeptFace->release();
+        sKeptFace = this;
+    }
+}
+
+void
+XeTeXFontFace::release()
+{
+    if (--m_refCount == 0) {
+        sFacePool.erase(FacePoolKey(m_pathname, m_index));
+        delete this;
+    }
+}
+
+XeTeXFontFace::XeTeXFontFace(const char* pathname, int index, FT_Face ftFace, hb_blob_t* fileBlob)
+    : m_pathname(pathname)
+    , m_index(index)
+    , m_refCount(1)
+    , m_ftFace(ftFace)
+    , m_hbFace(NULL)
+    , m_fileBlob(fileBlob)
+    , m_ftLibrary(NULL)
+    , m_glyphMetrics(NULL)
+    , m_glyphExtents(NULL)
+    , m_layoutInfo(NULL)
+    , m_sizeParamsState(0)
+    , m_charPages(NULL)
+    , m_charMapLoaded(false)
+    , m_charMapComplete(true)
+    , m_firstChar(0)
+    , m_lastChar(0)
+    , m_glyphNames(NULL)
+    , m_glyphNameIndex(NULL)
+{
+    m_advances[0] = m_advances[1] = NULL;
+    m_advancesLoaded[0] = m_advancesLoaded[1] = false;
+#ifndef WIN32
+    pthread_mutex_init(&m_mutex, NULL);
+#endif
+
+    // FreeType may be reading from the mapped file even if HarfBuzz can't
+    m_tablesMapped = m_fileBlob != NULL && _is_plain_sfnt(m_fileBlob);
+
+    int prevPhase = fontloadphase(FONT_PHASE_HB_FACE);
+    if (m_tablesMapped) {
+        // tables are then just pointers into the mapped file
+        m_hbFace = hb_face_create(m_fileBlob, index);
+    } else {
+        m_hbFace = hb_face_create_for_tables(_get_table, this, NULL);
+        hb_face_set_index(m_hbFace, index);
+    }
+    hb_face_set_upem(m_hbFace, m_ftFace->units_per_EM);
+    fontloadphase(prevPhase);
+}
+
+XeTeXFontFace::~XeTeXFontFace()
+{
+    hb_face_destroy(m_hbFace);
+    FT_Done_Face(m_ftFace);
+    if (m_ftLibrary != NULL)
+        FT_Done_FreeType(m_ftLibrary);
+    hb_blob_destroy(m_fileBlob);
+    delete[] m_glyphMetrics;
+    delete[] m_glyphExtents;
+    delete[] m_advances[0];
+    delete[] m_advances[1];
+    delete m_layoutInfo;
+    if (m_charPages != NULL) {
+        for (int i = 0; i < CHAR_PAGE_COUNT; ++i)
+            delete[] m_charPages[i];
+        delete[] m_charPages;
+    }
+    delete m_glyphNames;
+    delete m_glyphNameIndex;
+    for (std::map<hb_tag_t,hb_blob_t*>::iterator i = m_tables.begin(); i != m_tables.end(); ++i)
+        hb_blob_destroy(i->second);
+#ifndef WIN32
+    pthread_mutex_destroy(&m_mutex);
+#endif
+}
+
+void
+XeTeXFontInst::initialize(const char* pathname, int index, int &status)
+{
+    TT_Postscript *postTable;
+    TT_OS2* os2Table;
+
+    m_face = XeTeXFontFace::acquire(pathname, index);
+    if (m_face == NULL) {
+        status = 1;
+        return;
+    }
+
+    m_ftFace = m_face->getFTFace();
     m_filename = xstrdup(pathname);
     m_index = index;
     m_unitsPerEM = m_ftFace->units_per_EM;
@@ -342,20 +870,18 @@ XeTeXFontInst::initialize(const char* pathname, int index, int &status)
         m_xHeight = unitsToPoints(os2Table->sxHeight);
     }
 
-    // Set up HarfBuzz font
-    hbFace = hb_face_create_for_tables(_get_table, m_ftFace, NULL);
-    hb_face_set_index(hbFace, index);
-    hb_face_set_upem(hbFace, m_unitsPerEM);
-    m_hbFont = hb_font_create(hbFace);
-    hb_face_destroy(hbFace);
+    // Set up HarfBuzz font; only this is specific to the size, the face is shared
+    int prevPhase = fontloadphase(FONT_PHASE_HB_FACE);
+    m_hbFont = hb_font_create(m_face->getHbFace());
 
     if (hbFontFuncs == NULL)
         hbFontFuncs = _get_font_funcs();
 
-    hb_font_set_funcs(m_hbFont, hbFontFuncs, m_ftFace, NULL);
+    hb_font_set_funcs(m_hbFont, hbFontFuncs, m_face, NULL);
     hb_font_set_scale(m_hbFont, m_unitsPerEM, m_unitsPerEM);
     // We don’t want device tables adjustments
     hb_font_set_ppem(m_hbFont, 0, 0);
+    fontloadphase(prevPhase);
 
     return;
 }
@@ -364,26 +890,313 @@ void
 XeTeXFontInst::setLayoutDirVertical(bool vertical)
 {
     m_vertical = vertical;
+    if (vertical && preloadAdvances())
+        m_face->loadAdvances(true);
 }
 
-void *
-XeTeXFontInst::getFontTable(OTTag tag) const
+void
+XeTeXFontFace::loadCharMap()
 {
-    FT_ULong tmpLength = 0;
-    FT_Error error = FT_Load_Sfnt_Table(m_ftFace, tag, 0, NULL, &tmpLength);
-    if (error)
+    // not while shaping is threaded: the workers read the pages unlocked
+    if (m_charMapLoaded)
+        return;
+
+    m_charPages = new uint16_t*[CHAR_PAGE_COUNT];
+    std::fill(m_charPages, m_charPages + CHAR_PAGE_COUNT, (uint16_t*) NULL);
+
+    FT_UInt gid;
+    FT_ULong ch = FT_Get_First_Char(m_ftFace, &gid);
+    m_firstChar = m_lastChar = ch;
+    while (gid != 0) {
+        m_lastChar = ch;
+        if (ch < 0x110000 && gid <= 0xFFFF) {
+            uint16_t*& page = m_charPages[ch >> 8];
+            if (page == NULL) {
+                page = new uint16_t[256];
+                std::fill(page, page + 256, 0);
+            }
+            page[ch & 0xFF] = gid;
+        } else
+            m_charMapComplete = false;
+        ch = FT_Get_Next_Char(m_ftFace, ch, &gid);
+    }
+
+    m_charMapLoaded = true;
+}
+
+unsigned int
+XeTeXFontFace::mapCharToGlyph(UChar32 ch)
+{
+    if (!m_charMapLoaded) {
+        if (sThreaded) {
+            FreeTypeLock lock(this);
+            return FT_Get_Char_Index(m_ftFace, ch);
+        }
+        loadCharMap();
+    }
+
+    if (ch >= 0 && ch < 0x110000) {
+        const uint16_t* page = m_charPages[ch >> 8];
+        if (page != NULL && page[ch & 0xFF] != 0)
+            return page[ch & 0xFF];
+        if (m_charMapComplete)
+            return 0;
+    }
+
+    FreeTypeLock lock(this);
+    return FT_Get_Char_Index(m_ftFace, ch);
+}
+
+UChar32
+XeTeXFontFace::getFirstCharCode()
+{
+    if (!m_charMapLoaded)
+        loadCharMap();
+    return m_firstChar;
+}
+
+UChar32
+XeTeXFontFace::getLastCharCode()
+{
+    if (!m_charMapLoaded)
+        loadCharMap();
+    return m_lastChar;
+}
+
+void
+XeTeXFontFace::loadGlyphNames()
+{
+    m_glyphNames = new std::vector<std::string>;
+    m_glyphNameIndex = new XeTeXHash::unordered_map<std::string,unsigned int>;
+    if (!FT_HAS_GLYPH_NAMES(m_ftFace))
+        return;
+
+    m_glyphNames->resize(m_ftFace->num_glyphs);
+    for (FT_Long gid = 0; gid < m_ftFace->num_glyphs; ++gid) {
+        char buffer[256];
+        if (FT_Get_Glyph_Name(m_ftFace, gid, buffer, sizeof(buffer)) != 0)
+            continue;
+        (*m_glyphNames)[gid] = buffer;
+        // like FT_Get_Name_Index, find the first glyph with the name
+        m_glyphNameIndex->insert(std::make_pair(std::string(buffer), (unsigned int) gid));
+    }
+}
+
+unsigned int
+XeTeXFontFace::mapGlyphNameToIndex(const char* glyphName)
+{
+    if (m_glyphNameIndex == NULL)
+        loadGlyphNames();
+
+    XeTeXHash::unordered_map<std::string,unsigned int>::const_iterator i = m_glyphNameIndex->find(glyphName);
+    return i != m_glyphNameIndex->end() ? i->second : 0;
+}
+
+const char*
+XeTeXFontFace::getGlyphName(unsigned int gid, int& nameLen)
+{
+    if (m_glyphNames == NULL)
+        loadGlyphNames();
+
+    if (!FT_HAS_GLYPH_NAMES(m_ftFace)) {
+        nameLen = 0;
         return NULL;
+    }
 
-    void* table = xmalloc(tmpLength * sizeof(char));
-    if (table != NULL) {
-        error = FT_Load_Sfnt_Table(m_ftFace, tag, 0, (FT_Byte*)table, &tmpLength);
-        if (error) {
-            free((void *) table);
-            return NULL;
+    static const std::string noName;
+    const std::string& name = gid < m_glyphNames->size() ? (*m_glyphNames)[gid] : noName;
+    nameLen = name.length();
+    return name.c_str();
+}
+
+#define UNKNOWN_ADVANCE INT32_MIN
+
+int32_t*
+XeTeXFontFace::allocAdvances(bool vertical)
+{
+    if (m_advances[vertical] == NULL) {
+        int32_t* advances = new int32_t[m_ftFace->num_glyphs];
+        std::fill(advances, advances + m_ftFace->num_glyphs, UNKNOWN_ADVANCE);
+        m_advances[vertical] = advances;
+    }
+    return m_advances[vertical];
+}
+
+void
+XeTeXFontFace::loadAdvances(bool vertical)
+{
+    // not while shaping is threaded: the workers read the table unlocked
+    if (m_advancesLoaded[vertical])
+        return;
+    m_advancesLoaded[vertical] = true;
+
+    // FreeType reads the whole hmtx (or vmtx) table in one go here
+    int32_t* advances = allocAdvances(vertical);
+    FT_Long numGlyphs = m_ftFace->num_glyphs;
+    FT_Fixed* ftAdvances = new FT_Fixed[numGlyphs];
+    int flags = FT_LOAD_NO_SCALE;
+
+    if (vertical)
+        flags |= FT_LOAD_VERTICAL_LAYOUT;
+
+    if (FT_Get_Advances(m_ftFace, 0, numGlyphs, flags, ftAdvances) == 0) {
+        for (FT_Long i = 0; i < numGlyphs; i++)
+            advances[i] = vertical ? -ftAdvances[i] : ftAdvances[i];
+    }
+
+    delete[] ftAdvances;
+}
+
+int32_t
+XeTeXFontFace::getGlyphAdvance(unsigned int gid, bool vertical)
+{
+    if (gid >= (unsigned int) m_ftFace->num_glyphs) {
+        FreeTypeLock lock(this);
+        return _get_glyph_advance(m_ftFace, gid, vertical);
+    }
+
+    if (sThreaded) {
+        const int32_t* advances = m_advances[vertical];
+        if (advances != NULL && advances[gid] != UNKNOWN_ADVANCE)
+            return advances[gid];
+        FreeTypeLock lock(this);
+        return _get_glyph_advance(m_ftFace, gid, vertical);
+    }
+
+    int32_t* advances = allocAdvances(vertical);
+    if (advances[gid] == UNKNOWN_ADVANCE)
+        advances[gid] = _get_glyph_advance(m_ftFace, gid, vertical);
+
+    return advances[gid];
+}
+
+bool
+XeTeXFontFace::getGlyphExtents(unsigned int gid, hb_glyph_extents_t* extents)
+{
+    // an entry is filled in several steps, so it is always read under the lock
+    FreeTypeLock lock(this);
+    if (gid >= (unsigned int) m_ftFace->num_glyphs)
+        return false;
+
+    if (m_glyphExtents == NULL) {
+        m_glyphExtents = new GlyphExtents[m_ftFace->num_glyphs];
+        memset(m_glyphExtents, 0, m_ftFace->num_glyphs * sizeof(GlyphExtents));
+    }
+
+    GlyphExtents& cached = m_glyphExtents[gid];
+    if (!cached.valid) {
+        cached.valid = true;
+        FT_Error error = FT_Load_Glyph (m_ftFace, gid, FT_LOAD_NO_SCALE);
+        if (!error) {
+            cached.found = true;
+            cached.extents.x_bearing = m_ftFace->glyph->metrics.horiBearingX;
+            cached.extents.y_bearing = m_ftFace->glyph->metrics.horiBearingY;
+            cached.extents.width  =  m_ftFace->glyph->metrics.width;
+            cached.extents.height = -m_ftFace->glyph->metrics.height;
+        }
+    }
+
+    if (cached.found)
+        *extents = cached.extents;
+
+    return cached.found;
+}
+
+static void
+_get_feature_tags(hb_face_t* face, hb_tag_t tableTag, unsigned int script, unsigned int language, std::vector<hb_tag_t>& features)
+{
+    unsigned int count = hb_ot_layout_language_get_feature_tags(face, tableTag, script, language, 0, NULL, NULL);
+    features.resize(count);
+    if (count > 0)
+        hb_ot_layout_language_get_feature_tags(face, tableTag, script, language, 0, &count, &features[0]);
+}
+
+const XeTeXFontFace::SizeParams*
+XeTeXFontFace::getSizeParams()
+{
+    if (m_sizeParamsState == 0) {
+        unsigned int designSize, minSize, maxSize;
+        if (hb_ot_layout_get_size_params(m_hbFace, &designSize, &m_sizeParams.subFamilyID,
+                                         &m_sizeParams.nameCode, &minSize, &maxSize)) {
+            // Convert sizes from PostScript deci-points to TeX points
+            m_sizeParams.designSize = designSize * 72.27 / 72.0 / 10.0;
+            m_sizeParams.minSize = minSize * 72.27 / 72.0 / 10.0;
+            m_sizeParams.maxSize = maxSize * 72.27 / 72.0 / 10.0;
+            m_sizeParamsState = 2;
+        } else
+            m_sizeParamsState = 1;
+    }
+
+    return m_sizeParamsState == 2 ? &m_sizeParams : NULL;
+}
+
+double
+XeTeXFontFace::getDesignSize()
+{
+    const SizeParams* params = getSizeParams();
+    return params != NULL ? params->designSize : 10.0;
+}
+
+const OTLayoutInfo&
+XeTeXFontFace::getLayoutInfo()
+{
+    if (m_layoutInfo != NULL)
+        return *m_layoutInfo;
+
+    m_layoutInfo = new OTLayoutInfo;
+    for (int i = 0; i < 2; ++i) {
+        hb_tag_t tableTag = i == 0 ? HB_OT_TAG_GSUB : HB_OT_TAG_GPOS;
+        std::vector<OTScriptInfo>& scripts = m_layoutInfo->scripts[i];
+
+        unsigned int scriptCount = hb_ot_layout_table_get_script_tags(m_hbFace, tableTag, 0, NULL, NULL);
+        std::vector<hb_tag_t> scriptTags(scriptCount);
+        if (scriptCount > 0)
+            hb_ot_layout_table_get_script_tags(m_hbFace, tableTag, 0, &scriptCount, &scriptTags[0]);
+
+        scripts.resize(scriptCount);
+        for (unsigned int j = 0; j < scriptCount; ++j) {
+            OTScriptInfo& script = scripts[j];
+            script.tag = scriptTags[j];
+
+            unsigned int langCount = hb_ot_layout_script_get_language_tags(m_hbFace, tableTag, j, 0, NULL, NULL);
+            std::vector<hb_tag_t> langTags(langCount);
+            if (langCount > 0)
+                hb_ot_layout_script_get_language_tags(m_hbFace, tableTag, j, 0, &langCount, &langTags[0]);
+
+            script.languages.resize(langCount);
+            for (unsigned int k = 0; k < langCount; ++k) {
+                script.languages[k].tag = langTags[k];
+                _get_feature_tags(m_hbFace, tableTag, j, k, script.languages[k].features);
+            }
+
+            // language 0 gets the 'dflt' language system or else the default one
+            unsigned int langIndex = 0;
+            hb_ot_layout_script_find_language(m_hbFace, tableTag, j, 0, &langIndex);
+            _get_feature_tags(m_hbFace, tableTag, j, langIndex, script.defaultFeatures);
         }
     }
 
-    return table;
+    return *m_layoutInfo;
+}
+
+const void*
+XeTeXFontFace::getTable(hb_tag_t tag)
+{
+    // the blob is kept as long as the face, whether it is a view into the
+    // mapped file or a copy that FreeType read for us
+    hb_blob_t*& blob = m_tables[tag];
+    if (blob == NULL)
+        blob = hb_face_reference_table(m_hbFace, tag);
+
+    unsigned int length;
+    const char* table = hb_blob_get_data(blob, &length);
+    return length > 0 ? table : NULL;
+}
+
+const void *
+XeTeXFontInst::getFontTable(OTTag tag) const
+{
+    return m_face->getTable(tag);
 }
 
 void *
@@ -392,32 +1205,58 @@ XeTeXFontInst::getFontTable(FT_Sfnt_Tag tag) const
     return FT_Get_Sfnt_Table(m_ftFace, tag);
 }
 
-void
-XeTeXFontInst::getGlyphBounds(GlyphID gid, GlyphBBox* bbox)
+const XeTeXFontFace::GlyphMetrics&
+XeTeXFontFace::getGlyphMetrics(unsigned int gid)
 {
-    bbox->xMin = bbox->yMin = bbox->xMax = bbox->yMax = 0.0;
+    static GlyphMetrics empty = { true, 0, 0, 0, 0 };
 
-    FT_Error error = FT_Load_Glyph(m_ftFace, gid, FT_LOAD_NO_SCALE);
-    if (error)
-        return;
+    if (gid >= (unsigned int) m_ftFace->num_glyphs)
+        return empty;
 
-    FT_Glyph glyph;
-    error = FT_Get_Glyph(m_ftFace->glyph, &glyph);
-    if (error == 0) {
-        FT_BBox ft_bbox;
-        FT_Glyph_Get_CBox(glyph, FT_GLYPH_BBOX_UNSCALED, &ft_bbox);
-        bbox->xMin = unitsToPoints(ft_bbox.xMin);
-        bbox->yMin = unitsToPoints(ft_bbox.yMin);
-        bbox->xMax = unitsToPoints(ft_bbox.xMax);
-        bbox->yMax = unitsToPoints(ft_bbox.yMax);
-        FT_Done_Glyph(glyph);
+    if (m_glyphMetrics == NULL) {
+        m_glyphMetrics = new GlyphMetrics[m_ftFace->num_glyphs];
+        memset(m_glyphMetrics, 0, m_ftFace->num_glyphs * sizeof(GlyphMetrics));
     }
+
+    GlyphMetrics& metrics = m_glyphMetrics[gid];
+    if (!metrics.valid) {
+        metrics.valid = true;
+
+        FT_Error error = FT_Load_Glyph(m_ftFace, gid, FT_LOAD_NO_SCALE);
+        if (error)
+            return metrics;
+
+        FT_Glyph glyph;
+        error = FT_Get_Glyph(m_ftFace->glyph, &glyph);
+        if (error == 0) {
+            FT_BBox ft_bbox;
+            FT_Glyph_Get_CBox(glyph, FT_GLYPH_BBOX_UNSCALED, &ft_bbox);
+            metrics.xMin = ft_bbox.xMin;
+            metrics.yMin = ft_bbox.yMin;
+            metrics.xMax = ft_bbox.xMax;
+            metrics.yMax = ft_bbox.yMax;
+            FT_Done_Glyph(glyph);
+        }
+    }
+
+    return metrics;
+}
+
+void
+XeTeXFontInst::getGlyphBounds(GlyphID gid, GlyphBBox* bbox)
+{
+    const XeTeXFontFace::GlyphMetrics& metrics = m_face->getGlyphMetrics(gid);
+
+    bbox->xMin = unitsToPoints(metrics.xMin);
+    bbox->yMin = unitsToPoints(metrics.yMin);
+    bbox->xMax = unitsToPoints(metrics.xMax);
+    bbox->yMax = unitsToPoints(metrics.yMax);
 }
 
 GlyphID
 XeTeXFontInst::mapCharToGlyph(UChar32 ch) const
 {
-    return FT_Get_Char_Index(m_ftFace, ch);
+    return m_face->mapCharToGlyph(ch);
 }
 
 uint16_t
@@ -429,7 +1268,7 @@ XeTeXFontInst::getNumGlyphs() const
 float
 XeTeXFontInst::getGlyphWidth(GlyphID gid)
 {
-    return unitsToPoints(_get_glyph_advance(m_ftFace, gid, false));
+    return unitsToPoints(m_face->getGlyphAdvance(gid, false));
 }
 
 void
@@ -477,40 +1316,23 @@ XeTeXFontInst::getGlyphItalCorr(GlyphID gid)
 GlyphID
 XeTeXFontInst::mapGlyphToIndex(const char* glyphName) const
 {
-    return FT_Get_Name_Index(m_ftFace, const_cast<char*>(glyphName));
+    return m_face->mapGlyphNameToIndex(glyphName);
 }
 
 const char*
 XeTeXFontInst::getGlyphName(GlyphID gid, int& nameLen)
 {
-    if (FT_HAS_GLYPH_NAMES(m_ftFace)) {
-        static char buffer[256];
-        FT_Get_Glyph_Name(m_ftFace, gid, buffer, 256);
-        nameLen = strlen(buffer);
-        return &buffer[0];
-    }
-    else {
-        nameLen = 0;
-        return NULL;
-    }
+    return m_face->getGlyphName(gid, nameLen);
 }
 
 UChar32
 XeTeXFontInst::getFirstCharCode()
 {
-    FT_UInt gindex;
-    return FT_Get_First_Char(m_ftFace, &gindex);
+    return m_face->getFirstCharCode();
 }
 
 UChar32
 XeTeXFontInst::getLastCharCode()
 {
-    FT_UInt gindex;
-    UChar32 ch = FT_Get_First_Char(m_ftFace, &gindex);
-    UChar32 prev = ch;
-    while (gindex != 0) {
-        prev = ch;
-        ch = FT_Get_Next_Char(m_ftFace, ch, &gindex);
-    }
-    return prev;
+    return m_face->getLastCharCode();
 }
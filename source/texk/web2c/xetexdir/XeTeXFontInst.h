@@ -46,9 +46,151 @@ authorization from the copyright holders.
 #include "XeTeXFontMgr.h"
 
 #include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_TRUETYPE_TABLES_H
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+class XeTeXFontFace;
+
+// a FreeType face (and our caches of what we read from it) must not be used
+// from two threads at once; while words are being shaped on worker threads
+// this takes the lock of the face's FreeType library, otherwise it does nothing
+
+class FreeTypeLock
+{
+public:
+    FreeTypeLock(XeTeXFontFace* face);
+    ~FreeTypeLock();
+
+    static void setThreaded(bool threaded);
+
+private:
+    XeTeXFontFace* m_face;
+};
+
+// the scripts, languages and features of a font's GSUB and GPOS tables,
+// as reported by the \XeTeXOT... primitives
+
+struct OTLanguageInfo {
+    hb_tag_t tag;
+    std::vector<hb_tag_t> features;
+};
+
+struct OTScriptInfo {
+    hb_tag_t tag;
+    std::vector<OTLanguageInfo> languages;
+    std::vector<hb_tag_t> defaultFeatures; // for language 0
+};
+
+struct OTLayoutInfo {
+    std::vector<OTScriptInfo> scripts[2]; // GSUB, GPOS
+};
+
+// a font file opened with FreeType and HarfBuzz; it is shared by all the
+// XeTeXFontInst objects (i.e., sizes) made from the same file and face index,
+// together with the glyph metrics, which are all kept in font units
+
+class XeTeXFontFace
+{
+public:
+    struct GlyphMetrics {
+        bool valid;
+        int32_t xMin, yMin, xMax, yMax;
+    };
+
+    // from the GPOS 'size' feature, in TeX points
+    struct SizeParams {
+        double designSize;
+        double minSize;
+        double maxSize;
+        unsigned int subFamilyID;
+        unsigned int nameCode;
+    };
+
+    static XeTeXFontFace* acquire(const char* pathname, int index);
+    void release();
+    void keep();
+
+    static void startPreloading(const char* faceListPath);
+    static void writeFaceList();
+    static void getPreloadStats(long* preloaded, long* used);
+
+    FT_Face getFTFace() const { return m_ftFace; }
+    hb_face_t* getHbFace() const { return m_hbFace; }
+    const void* getTable(hb_tag_t tag);
+
+    const GlyphMetrics& getGlyphMetrics(unsigned int gid);
+    int32_t getGlyphAdvance(unsigned int gid, bool vertical);
+    bool getGlyphExtents(unsigned int gid, hb_glyph_extents_t* extents);
+    void loadAdvances(bool vertical);
+    void loadCharMap();
+    const OTLayoutInfo& getLayoutInfo();
+    const SizeParams* getSizeParams();
+    double getDesignSize();
+
+    unsigned int mapGlyphNameToIndex(const char* glyphName);
+    const char* getGlyphName(unsigned int gid, int& nameLen);
+
+    unsigned int mapCharToGlyph(UChar32 ch);
+    UChar32 getFirstCharCode();
+    UChar32 getLastCharCode();
+
+private:
+    XeTeXFontFace(const char* pathname, int index, FT_Face ftFace, hb_blob_t* fileBlob);
+    ~XeTeXFontFace();
+
+    struct GlyphExtents {
+        bool valid;
+        bool found;
+        hb_glyph_extents_t extents;
+    };
+
+    std::string m_pathname;
+    int m_index;
+    int m_refCount;
+
+    FT_Face m_ftFace;
+    hb_face_t* m_hbFace;
+    hb_blob_t* m_fileBlob; // the memory-mapped font file, if any
+    bool m_tablesMapped; // HarfBuzz reads the tables from m_fileBlob
+    std::map<hb_tag_t,hb_blob_t*> m_tables; // handed out by getTable()
+    FT_Library m_ftLibrary; // the face's own library, if it was preloaded
+
+    // filled in lazily and indexed by glyph ID
+    GlyphMetrics* m_glyphMetrics;
+    GlyphExtents* m_glyphExtents;
+    int32_t* m_advances[2]; // horizontal and vertical
+    bool m_advancesLoaded[2];
+    OTLayoutInfo* m_layoutInfo;
+    SizeParams m_sizeParams;
+    int m_sizeParamsState; // 0 = not read yet, 1 = none, 2 = valid
+
+    // the cmap, read once: glyph IDs by character code, in pages of 256 codes
+    // (a missing page has no characters)
+    uint16_t** m_charPages;
+    bool m_charMapLoaded;
+    bool m_charMapComplete; // false if the cmap has codes beyond Unicode
+    UChar32 m_firstChar;
+    UChar32 m_lastChar;
+
+    // glyph names by glyph ID, and the reverse, read on first use
+    std::vector<std::string>* m_glyphNames;
+    XeTeXHash::unordered_map<std::string,unsigned int>* m_glyphNameIndex;
+
+    int32_t* allocAdvances(bool vertical);
+    void loadGlyphNames();
+
+    friend class FreeTypeLock;
+#ifndef WIN32
+    pthread_mutex_t m_mutex; // the lock for m_ftLibrary, if the face has one
+#endif
+};
 
 // create specific subclasses for each supported platform
 
@@ -68,6 +210,7 @@ protected:
     char *m_filename; // font filename
     uint32_t m_index; // face index
 
+    XeTeXFontFace* m_face;
     FT_Face m_ftFace;
     hb_font_t* m_hbFont;
 
@@ -79,7 +222,7 @@ public:
 
     void initialize(const char* pathname, int index, int &status);
 
-    void *getFontTable(OTTag tableTag) const;
+    const void *getFontTable(OTTag tableTag) const;
     void *getFontTable(FT_Sfnt_Tag tableTag) const;
 
     const char *getFilename(uint32_t* index) const
@@ -88,6 +231,8 @@ public:
         return m_filename;
     }
     hb_font_t *getHbFont() const { return m_hbFont; }
+    XeTeXFontFace* getFace() const { return m_face; }
+
     void setLayoutDirVertical(bool vertical);
     bool getLayoutDirVertical() const { return m_vertical; };
 
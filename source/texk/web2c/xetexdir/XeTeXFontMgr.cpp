@@ -68,19 +68,30 @@ XeTeXFontMgr::GetFontManager()
     if (sFontManager == NULL) {
 #ifdef XETEX_MAC
         sFontManager = new XeTeXFontMgr_Mac;
+        sFontManager->startUp(); // just sets up an autorelease pool
 #else
+        // Fontconfig isn't started until a font is looked up by name,
+        // so documents that only load fonts by file name never need it
         sFontManager = new XeTeXFontMgr_FC;
 #endif
-        sFontManager->initialize();
     }
 
     return sFontManager;
 }
 
+void
+XeTeXFontMgr::startUp()
+{
+    if (!m_started) {
+        initialize();
+        m_started = true;
+    }
+}
+
 void
 XeTeXFontMgr::Terminate()
 {
-    if (sFontManager != NULL) {
+    if (sFontManager != NULL && sFontManager->m_started) {
         sFontManager->terminate();
         // we don't actually deallocate the manager, just ask it to clean up
         // any auxiliary data such as the cocoa pool or freetype/fontconfig stuff
@@ -98,11 +109,13 @@ XeTeXFontMgr::findFont(const char* name, char* variant, double ptSize)
     double dsize = 10.0;
     loadedfontdesignsize = 655360L;
 
+    startUp();
+
     for (int pass = 0; pass < 2; ++pass) {
         // try full name as given
-        std::map<std::string,Font*>::iterator i = m_nameToFont.find(nameStr);
-        if (i != m_nameToFont.end()) {
-            font = i->second;
+        NameToFontMap::iterator n = m_nameToFont.find(nameStr);
+        if (n != m_nameToFont.end()) {
+            font = n->second;
             if (font->opSizeInfo.designSize != 0.0)
                 dsize = font->opSizeInfo.designSize;
             break;
@@ -112,10 +125,10 @@ XeTeXFontMgr::findFont(const char* name, char* variant, double ptSize)
         int hyph = nameStr.find('-');
         if (hyph > 0 && hyph < nameStr.length() - 1) {
             std::string family(nameStr.begin(), nameStr.begin() + hyph);
-            std::map<std::string,Family*>::iterator f = m_nameToFamily.find(family);
+            NameToFamilyMap::iterator f = m_nameToFamily.find(family);
             if (f != m_nameToFamily.end()) {
                 std::string style(nameStr.begin() + hyph + 1, nameStr.end());
-                i = f->second->styles->find(style);
+                std::map<std::string,Font*>::iterator i = f->second->styles->find(style);
                 if (i != f->second->styles->end()) {
                     font = i->second;
                     if (font->opSizeInfo.designSize != 0.0)
@@ -126,18 +139,19 @@ XeTeXFontMgr::findFont(const char* name, char* variant, double ptSize)
         }
 
         // try as PostScript name
-        i = m_psNameToFont.find(nameStr);
-        if (i != m_psNameToFont.end()) {
-            font = i->second;
+        n = m_psNameToFont.find(nameStr);
+        if (n != m_psNameToFont.end()) {
+            font = n->second;
             if (font->opSizeInfo.designSize != 0.0)
                 dsize = font->opSizeInfo.designSize;
             break;
         }
 
         // try for the name as a family name
-        std::map<std::string,Family*>::iterator f = m_nameToFamily.find(nameStr);
+        NameToFamilyMap::iterator f = m_nameToFamily.find(nameStr);
 
         if (f != m_nameToFamily.end()) {
+            std::map<std::string,Font*>::iterator i;
             // look for a family member with the "regular" bit set in OS/2
             int regFonts = 0;
             for (i = f->second->styles->begin(); i != f->second->styles->end(); ++i)
@@ -399,7 +413,7 @@ XeTeXFontMgr::findFont(const char* name, char* variant, double ptSize)
 const char*
 XeTeXFontMgr::getFullName(PlatformFontRef font) const
 {
-    std::map<PlatformFontRef,Font*>::const_iterator i = m_platformRefToFont.find(font);
+    PlatformRefToFontMap::const_iterator i = m_platformRefToFont.find(font);
     if (i == m_platformRefToFont.end())
         die("internal error %d in XeTeXFontMgr", 2);
     if (i->second->m_fullName != NULL)
@@ -446,43 +460,28 @@ XeTeXFontMgr::bestMatchFromFamily(const Family* fam, int wt, int wd, int slant)
     return bestMatch;
 }
 
-const XeTeXFontMgr::OpSizeRec*
-XeTeXFontMgr::getOpSize(XeTeXFont font)
+bool
+XeTeXFontMgr::getOpSize(XeTeXFont font, OpSizeRec* sizeRec)
 {
-    hb_font_t* hbFont = ((XeTeXFontInst*)font)->getHbFont();
-    if (hbFont != NULL) {
-        hb_face_t* face = hb_font_get_face(hbFont);
-        OpSizeRec* pSizeRec = (OpSizeRec*) xmalloc(sizeof(OpSizeRec));
-
-        unsigned int designSize, minSize, maxSize;
-        bool ok = hb_ot_layout_get_size_params(face,
-                &designSize,
-                &pSizeRec->subFamilyID,
-                &pSizeRec->nameCode,
-                &minSize,
-                &maxSize);
-
-        if (ok) {
-            // Convert sizes from PostScript deci-points to TeX points
-            pSizeRec->designSize = designSize * 72.27 / 72.0 / 10.0;
-            pSizeRec->minSize = minSize * 72.27 / 72.0 / 10.0;
-            pSizeRec->maxSize = maxSize * 72.27 / 72.0 / 10.0;
-            return pSizeRec;
-        }
-
-        free(pSizeRec);
-        return NULL;
-    }
-
-    return NULL;
+    // the face reads the 'size' feature once for all sizes of the font
+    const XeTeXFontFace::SizeParams* params = ((XeTeXFontInst*)font)->getFace()->getSizeParams();
+    if (params == NULL)
+        return false;
+
+    sizeRec->designSize = params->designSize;
+    sizeRec->minSize = params->minSize;
+    sizeRec->maxSize = params->maxSize;
+    sizeRec->subFamilyID = params->subFamilyID;
+    sizeRec->nameCode = params->nameCode;
+    return true;
 }
 
 double
 XeTeXFontMgr::getDesignSize(XeTeXFont font)
 {
-    const OpSizeRec* pSizeRec = getOpSize(font);
-    if (pSizeRec != NULL)
-        return pSizeRec->designSize;
+    OpSizeRec sizeRec;
+    if (getOpSize(font, &sizeRec))
+        return sizeRec.designSize;
     else
         return 10.0;
 }
@@ -493,7 +492,8 @@ XeTeXFontMgr::getOpSizeRecAndStyleFlags(Font* theFont)
     XeTeXFont font = createFont(theFont->fontRef, 655360);
     XeTeXFontInst* fontInst = (XeTeXFontInst*) font;
     if (font != 0) {
-        const OpSizeRec* pSizeRec = getOpSize(font);
+        OpSizeRec sizeRec;
+        const OpSizeRec* pSizeRec = getOpSize(font, &sizeRec) ? &sizeRec : NULL;
         if (pSizeRec != NULL) {
             theFont->opSizeInfo.designSize = pSizeRec->designSize;
             if (pSizeRec->subFamilyID == 0
@@ -591,7 +591,7 @@ XeTeXFontMgr::addToMaps(PlatformFontRef platformFont, const NameCollection* name
 
     std::list<std::string>::const_iterator i;
     for (i = names->m_familyNames.begin(); i != names->m_familyNames.end(); ++i) {
-        std::map<std::string,Family*>::iterator iFam = m_nameToFamily.find(*i);
+        NameToFamilyMap::iterator iFam = m_nameToFamily.find(*i);
         Family* family;
         if (iFam == m_nameToFamily.end()) {
             family = new Family;
@@ -635,7 +635,7 @@ XeTeXFontMgr::addToMaps(PlatformFontRef platformFont, const NameCollection* name
     }
 
     for (i = names->m_fullNames.begin(); i != names->m_fullNames.end(); ++i) {
-        std::map<std::string,Font*>::iterator iFont = m_nameToFont.find(*i);
+        NameToFontMap::iterator iFont = m_nameToFont.find(*i);
         if (iFont == m_nameToFont.end())
             m_nameToFont[*i] = thisFont;
 /*
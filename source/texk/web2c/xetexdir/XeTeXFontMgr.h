@@ -55,6 +55,15 @@ typedef FcPattern* PlatformFontRef;
 #include <list>
 #include <vector>
 
+// the name maps are only ever searched, so they can be hash tables
+#if __cplusplus >= 201103L || defined(_LIBCPP_VERSION)
+#include <unordered_map>
+namespace XeTeXHash = std;
+#else
+#include <tr1/unordered_map>
+namespace XeTeXHash = std::tr1;
+#endif
+
 class XeTeXFontMgr
 {
 public:
@@ -92,15 +101,23 @@ public:
 
     void                            setReqEngine(char reqEngine) const { sReqEngine = reqEngine; };
 
+    bool                            isStarted() const { return m_started; }
+        // whether the platform font list has been loaded
+
 protected:
     static XeTeXFontMgr*            sFontManager;
     static char                     sReqEngine;
 
                                     XeTeXFontMgr()
+                                        : m_started(false)
                                         { }
     virtual                         ~XeTeXFontMgr()
                                         { }
 
+    bool                            m_started;
+
+    void                            startUp();
+        // initialize the platform font list, if that hasn't been done yet
     virtual void                    initialize() = 0;
     virtual void                    terminate();
 
@@ -176,10 +193,14 @@ protected:
         std::string             m_subFamily;
     };
 
-    std::map<std::string,Font*>                 m_nameToFont;                     // maps full name (as used in TeX source) to font record
-    std::map<std::string,Family*>               m_nameToFamily;
-    std::map<PlatformFontRef,Font*>             m_platformRefToFont;
-    std::map<std::string,Font*>                 m_psNameToFont;                   // maps PS name (as used in .xdv) to font record
+    typedef XeTeXHash::unordered_map<std::string,Font*>        NameToFontMap;
+    typedef XeTeXHash::unordered_map<std::string,Family*>      NameToFamilyMap;
+    typedef XeTeXHash::unordered_map<PlatformFontRef,Font*>    PlatformRefToFontMap;
+
+    NameToFontMap                               m_nameToFont;                     // maps full name (as used in TeX source) to font record
+    NameToFamilyMap                             m_nameToFamily;
+    PlatformRefToFontMap                        m_platformRefToFont;
+    NameToFontMap                               m_psNameToFont;                   // maps PS name (as used in .xdv) to font record
 
     int             weightAndWidthDiff(const Font* a, const Font* b) const;
     int             styleDiff(const Font* a, int wt, int wd, int slant) const;
@@ -188,7 +209,7 @@ protected:
     void            prependToList(std::list<std::string>* list, const char* str);
     void            addToMaps(PlatformFontRef platformFont, const NameCollection* names);
 
-    const OpSizeRec* getOpSize(XeTeXFont font);
+    bool            getOpSize(XeTeXFont font, OpSizeRec* sizeRec);
 
     virtual void    getOpSizeRecAndStyleFlags(Font* theFont);
     virtual void    searchForHostPlatformFonts(const std::string& name) = 0;
@@ -31,6 +31,7 @@ authorization from the copyright holders.
 \****************************************************************************/
 
 #include <w2c/config.h>
+#include <kpathsea/kpathsea.h>
 
 #include "XeTeXFontMgr_FC.h"
 
@@ -44,6 +45,19 @@ authorization from the copyright holders.
 
 #include <unicode/ucnv.h>
 
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <direct.h>
+#include <process.h>
+#endif
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
 #define kFontFamilyName 1
 #define kFontStyleName  2
 #define kFontFullName   4
@@ -80,25 +94,581 @@ convertToUtf8(UConverter* conv, const unsigned char* name, int len)
     return buffer2;
 }
 
+/* Font name index
+
+   Finding out the names of a font means opening it with FreeType, and its
+   optical size and style flags come from loading it completely; with many
+   thousands of fonts installed, doing this for all of them (as we must when a
+   name can't be found through Fontconfig) takes a long time. So what we find
+   out is kept in an index file under TEXMFVAR, which later runs map into
+   memory and look up through hash tables on the face (file and index) and on
+   the full, family and PostScript names. Entries are checked against the size
+   and modification time of the font file rather than against the state of
+   Fontconfig's cache, so that a font that has changed is read again even if
+   Fontconfig hasn't noticed yet; fonts that Fontconfig no longer lists are
+   dropped when the index is written out again, which happens whenever
+   anything new had to be read. Like any other output file, the index is only
+   read and written where openin_any and openout_any allow (so with the usual
+   paranoid openout_any, only if TEXMFVAR is below TEXMFOUTPUT). Setting
+   xetex_font_index to false in texmf.cnf or the environment turns it off. */
+
+struct IndexedFace {
+    std::string             path;
+    int                     index;
+    int64_t                 mtime;
+    int64_t                 size;
+    std::list<std::string>  fullNames;
+    std::list<std::string>  familyNames;
+    std::list<std::string>  styleNames;
+    std::string             psName;
+    bool                    hasStyle;   // the following fields have been filled in
+    double                  designSize;
+    double                  minSize;
+    double                  maxSize;
+    unsigned int            subFamilyID;
+    unsigned int            nameCode;
+    uint16_t                weight;
+    uint16_t                width;
+    int16_t                 slant;
+    bool                    isReg;
+    bool                    isBold;
+    bool                    isItalic;
+};
+
+typedef std::pair<std::string,int> FaceKey;
+
+#define INDEX_MAGIC         "XeTeXFNI"
+#define INDEX_VERSION       1
+#define INDEX_BYTE_ORDER    0x01020304
+
+enum {
+    kIndexFullName,
+    kIndexFamilyName,
+    kIndexStyleName,
+    kIndexPSName
+};
+
+#define INDEX_FLAG_STYLE    1
+#define INDEX_FLAG_REGULAR  2
+#define INDEX_FLAG_BOLD     4
+#define INDEX_FLAG_ITALIC   8
+
+// the index file is laid out as the header, followed by the face and name
+// records, the two hash tables (of face or name record number + 1, with 0 for
+// an empty slot) and finally the pool of NUL-terminated strings
+struct IndexHeader {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byteOrder;
+    uint32_t    faceCount;
+    uint32_t    nameCount;
+    uint32_t    faceSlots;
+    uint32_t    nameSlots;
+    uint32_t    stringsSize;
+    uint32_t    reserved;
+};
+
+struct IndexFaceRec {
+    int64_t     mtime;
+    int64_t     size;
+    double      designSize;
+    double      minSize;
+    double      maxSize;
+    uint32_t    path;       // offsets into the string pool
+    int32_t     index;
+    uint32_t    subFamilyID;
+    uint32_t    nameCode;
+    uint32_t    firstName;  // the face's names are consecutive name records
+    uint32_t    nameCount;
+    uint16_t    weight;
+    uint16_t    width;
+    int16_t     slant;
+    uint16_t    flags;
+};
+
+struct IndexNameRec {
+    uint32_t    string;
+    uint32_t    kind;
+    uint32_t    face;
+};
+
+static const char*          sIndexData = NULL;  // the mapped index file, if any
+static size_t               sIndexLength = 0;
+static const IndexHeader*   sIndexHeader = NULL;
+static const IndexFaceRec*  sIndexFaces = NULL;
+static const IndexNameRec*  sIndexNames = NULL;
+static const uint32_t*      sIndexFaceTable = NULL;
+static const uint32_t*      sIndexNameTable = NULL;
+static const char*          sIndexStrings = NULL;
+
+// faces looked up or read in this run, and their full, family and PostScript names
+static std::map<FaceKey,IndexedFace>        sFaces;
+static std::multimap<std::string,FaceKey>   sFaceNames;
+static bool                                 sIndexDirty = false;
+
+static std::string
+fontIndexPath()
+{
+    static int enabled = -1;
+    static std::string path;
+    if (enabled < 0) {
+        char* v = kpse_var_value("xetex_font_index");
+        enabled = !(v && (*v == 'f' || *v == 'n' || *v == '0'));
+        free(v);
+        if (enabled) {
+            char* var = kpse_var_value("TEXMFVAR");
+            if (var != NULL && *var != 0) {
+                path = var;
+                path += "/xetex/fontnames.idx";
+            } else
+                enabled = 0;
+            free(var);
+        }
+    }
+    return path;
+}
+
+static uint32_t
+hashString(const char* s, uint32_t h = 2166136261u)
+{
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+static uint32_t
+hashFace(const char* path, int index)
+{
+    return (hashString(path) ^ (uint32_t) index) * 16777619u;
+}
+
+static bool
+statFontFile(const char* path, int64_t* mtime, int64_t* size)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return false;
+    *mtime = st.st_mtime;
+    *size = st.st_size;
+    return true;
+}
+
+static const char*
+indexString(uint32_t offset)
+{
+    return offset < sIndexHeader->stringsSize ? sIndexStrings + offset : "";
+}
+
+static void
+openFontIndex()
+{
+    std::string path = fontIndexPath();
+    if (path.empty() || !kpse_in_name_ok(path.c_str()))
+        return;
+
+    FILE* f = fopen(path.c_str(), FOPEN_RBIN_MODE);
+    if (f == NULL)
+        return;
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    if (length < (long) sizeof(IndexHeader)) {
+        fclose(f);
+        return;
+    }
+
+#ifndef WIN32
+    void* data = mmap(NULL, length, PROT_READ, MAP_SHARED, fileno(f), 0);
+    fclose(f);
+    if (data == MAP_FAILED)
+        return;
+#else
+    void* data = xmalloc(length);
+    fseek(f, 0, SEEK_SET);
+    bool ok = fread(data, 1, length, f) == (size_t) length;
+    fclose(f);
+    if (!ok) {
+        free(data);
+        return;
+    }
+#endif
+
+    const IndexHeader* header = (const IndexHeader*) data;
+    uint64_t needed = sizeof(IndexHeader)
+                    + (uint64_t) header->faceCount * sizeof(IndexFaceRec)
+                    + (uint64_t) header->nameCount * sizeof(IndexNameRec)
+                    + ((uint64_t) header->faceSlots + header->nameSlots) * sizeof(uint32_t)
+                    + header->stringsSize;
+    if (memcmp(header->magic, INDEX_MAGIC, 8) != 0 || header->version != INDEX_VERSION
+            || header->byteOrder != INDEX_BYTE_ORDER || needed != (uint64_t) length
+            || header->faceSlots == 0 || header->nameSlots == 0
+            || header->stringsSize == 0 || ((const char*) data)[length - 1] != 0) {
+        // not ours, or from a different version: it'll be replaced
+#ifndef WIN32
+        munmap(data, length);
+#else
+        free(data);
+#endif
+        return;
+    }
+
+    sIndexData = (const char*) data;
+    sIndexLength = length;
+    sIndexHeader = header;
+    sIndexFaces = (const IndexFaceRec*) (sIndexData + sizeof(IndexHeader));
+    sIndexNames = (const IndexNameRec*) (sIndexFaces + header->faceCount);
+    sIndexFaceTable = (const uint32_t*) (sIndexNames + header->nameCount);
+    sIndexNameTable = sIndexFaceTable + header->faceSlots;
+    sIndexStrings = (const char*) (sIndexNameTable + header->nameSlots);
+}
+
+static const IndexFaceRec*
+findIndexedFace(const char* path, int index)
+{
+    if (sIndexHeader == NULL)
+        return NULL;
+
+    uint32_t slots = sIndexHeader->faceSlots;
+    for (uint32_t i = hashFace(path, index) % slots, n = 0; n < slots; i = (i + 1) % slots, ++n) {
+        uint32_t entry = sIndexFaceTable[i];
+        if (entry == 0 || entry > sIndexHeader->faceCount)
+            break;
+        const IndexFaceRec* rec = &sIndexFaces[entry - 1];
+        if (rec->index == index && strcmp(indexString(rec->path), path) == 0)
+            return rec;
+    }
+
+    return NULL;
+}
+
+static IndexedFace&
+addFace(const char* path, int index)
+{
+    IndexedFace& face = sFaces[FaceKey(path, index)];
+    face.path = path;
+    face.index = index;
+    face.mtime = face.size = 0;
+    face.hasStyle = false;
+    return face;
+}
+
+static void
+addFaceNames(const IndexedFace& face)
+{
+    FaceKey key(face.path, face.index);
+    std::list<std::string>::const_iterator i;
+    for (i = face.fullNames.begin(); i != face.fullNames.end(); ++i)
+        sFaceNames.insert(std::make_pair(*i, key));
+    for (i = face.familyNames.begin(); i != face.familyNames.end(); ++i)
+        sFaceNames.insert(std::make_pair(*i, key));
+    if (face.psName.length() > 0)
+        sFaceNames.insert(std::make_pair(face.psName, key));
+}
+
+static void
+loadIndexedFace(const IndexFaceRec* rec, IndexedFace& face)
+{
+    face.mtime = rec->mtime;
+    face.size = rec->size;
+    for (uint32_t i = 0; i < rec->nameCount; ++i) {
+        if (rec->firstName + i >= sIndexHeader->nameCount)
+            break;
+        const IndexNameRec* name = &sIndexNames[rec->firstName + i];
+        const char* s = indexString(name->string);
+        switch (name->kind) {
+            case kIndexFullName:
+                face.fullNames.push_back(s);
+                break;
+            case kIndexFamilyName:
+                face.familyNames.push_back(s);
+                break;
+            case kIndexStyleName:
+                face.styleNames.push_back(s);
+                break;
+            case kIndexPSName:
+                face.psName = s;
+                break;
+        }
+    }
+    face.hasStyle = (rec->flags & INDEX_FLAG_STYLE) != 0;
+    face.designSize = rec->designSize;
+    face.minSize = rec->minSize;
+    face.maxSize = rec->maxSize;
+    face.subFamilyID = rec->subFamilyID;
+    face.nameCode = rec->nameCode;
+    face.weight = rec->weight;
+    face.width = rec->width;
+    face.slant = rec->slant;
+    face.isReg = (rec->flags & INDEX_FLAG_REGULAR) != 0;
+    face.isBold = (rec->flags & INDEX_FLAG_BOLD) != 0;
+    face.isItalic = (rec->flags & INDEX_FLAG_ITALIC) != 0;
+}
+
+// returns what we know about the face, if that is still up to date
+static IndexedFace*
+lookupFace(const char* path, int index)
+{
+    std::map<FaceKey,IndexedFace>::iterator i = sFaces.find(FaceKey(path, index));
+    if (i != sFaces.end())
+        return &i->second;
+
+    const IndexFaceRec* rec = findIndexedFace(path, index);
+    int64_t mtime, size;
+    if (rec == NULL || !statFontFile(path, &mtime, &size) || rec->mtime != mtime || rec->size != size)
+        return NULL;
+
+    IndexedFace& face = addFace(path, index);
+    loadIndexedFace(rec, face);
+    addFaceNames(face);
+    return &face;
+}
+
+// make a new entry for a face whose names have just been read
+static IndexedFace*
+recordFace(const char* path, int index)
+{
+    if (fontIndexPath().empty())
+        return NULL;
+
+    IndexedFace& face = addFace(path, index);
+    statFontFile(path, &face.mtime, &face.size);
+    sIndexDirty = true;
+    return &face;
+}
+
+// collect the faces known to have the name, of the given kinds
+static void
+findFacesByName(const std::string& name, bool familyOnly, std::set<FaceKey>& faces)
+{
+    std::pair<std::multimap<std::string,FaceKey>::const_iterator,
+              std::multimap<std::string,FaceKey>::const_iterator> range = sFaceNames.equal_range(name);
+    for (std::multimap<std::string,FaceKey>::const_iterator i = range.first; i != range.second; ++i) {
+        const IndexedFace& face = sFaces[i->second];
+        if (!familyOnly || std::find(face.familyNames.begin(), face.familyNames.end(), name) != face.familyNames.end())
+            faces.insert(i->second);
+    }
+
+    if (sIndexHeader == NULL)
+        return;
+
+    uint32_t slots = sIndexHeader->nameSlots;
+    for (uint32_t i = hashString(name.c_str()) % slots, n = 0; n < slots; i = (i + 1) % slots, ++n) {
+        uint32_t entry = sIndexNameTable[i];
+        if (entry == 0 || entry > sIndexHeader->nameCount)
+            break;
+        const IndexNameRec* rec = &sIndexNames[entry - 1];
+        if (rec->face >= sIndexHeader->faceCount || (familyOnly && rec->kind != kIndexFamilyName))
+            continue;
+        if (name != indexString(rec->string))
+            continue;
+        const IndexFaceRec* faceRec = &sIndexFaces[rec->face];
+        FaceKey key(indexString(faceRec->path), faceRec->index);
+        if (sFaces.find(key) == sFaces.end()) // else we know better already
+            faces.insert(key);
+    }
+}
+
+static uint32_t
+addIndexString(std::string& pool, std::map<std::string,uint32_t>& offsets, const std::string& s)
+{
+    std::map<std::string,uint32_t>::const_iterator i = offsets.find(s);
+    if (i != offsets.end())
+        return i->second;
+    uint32_t offset = pool.size();
+    pool.append(s.c_str(), s.size() + 1);
+    offsets[s] = offset;
+    return offset;
+}
+
+static void
+writeFontIndex(FcFontSet* allFonts)
+{
+    std::string path = fontIndexPath();
+    if (path.empty() || allFonts == NULL)
+        return;
+
+    // everything we know about the fonts that are currently installed
+    std::vector<IndexedFace> faces;
+    for (int f = 0; f < allFonts->nfont; ++f) {
+        char* pathname;
+        int index;
+        if (FcPatternGetString(allFonts->fonts[f], FC_FILE, 0, (FcChar8**)&pathname) != FcResultMatch
+                || FcPatternGetInteger(allFonts->fonts[f], FC_INDEX, 0, &index) != FcResultMatch)
+            continue;
+        std::map<FaceKey,IndexedFace>::const_iterator i = sFaces.find(FaceKey(pathname, index));
+        if (i != sFaces.end())
+            faces.push_back(i->second);
+        else {
+            const IndexFaceRec* rec = findIndexedFace(pathname, index);
+            if (rec != NULL) {
+                IndexedFace face;
+                face.path = pathname;
+                face.index = index;
+                loadIndexedFace(rec, face);
+                faces.push_back(face);
+            }
+        }
+    }
+
+    std::string strings(1, '\0');
+    std::map<std::string,uint32_t> stringOffsets;
+    std::vector<IndexFaceRec> faceRecs;
+    std::vector<IndexNameRec> nameRecs;
+
+    for (std::vector<IndexedFace>::const_iterator i = faces.begin(); i != faces.end(); ++i) {
+        IndexFaceRec rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.mtime = i->mtime;
+        rec.size = i->size;
+        rec.path = addIndexString(strings, stringOffsets, i->path);
+        rec.index = i->index;
+        rec.firstName = nameRecs.size();
+        if (i->hasStyle) {
+            rec.designSize = i->designSize;
+            rec.minSize = i->minSize;
+            rec.maxSize = i->maxSize;
+            rec.subFamilyID = i->subFamilyID;
+            rec.nameCode = i->nameCode;
+            rec.weight = i->weight;
+            rec.width = i->width;
+            rec.slant = i->slant;
+            rec.flags = INDEX_FLAG_STYLE
+                      | (i->isReg ? INDEX_FLAG_REGULAR : 0)
+                      | (i->isBold ? INDEX_FLAG_BOLD : 0)
+                      | (i->isItalic ? INDEX_FLAG_ITALIC : 0);
+        }
+
+        const std::list<std::string>* lists[3] = { &i->fullNames, &i->familyNames, &i->styleNames };
+        for (uint32_t kind = kIndexFullName; kind <= kIndexStyleName; ++kind)
+            for (std::list<std::string>::const_iterator j = lists[kind]->begin(); j != lists[kind]->end(); ++j) {
+                IndexNameRec name = { addIndexString(strings, stringOffsets, *j), kind, (uint32_t) faceRecs.size() };
+                nameRecs.push_back(name);
+            }
+        if (i->psName.length() > 0) {
+            IndexNameRec name = { addIndexString(strings, stringOffsets, i->psName), kIndexPSName, (uint32_t) faceRecs.size() };
+            nameRecs.push_back(name);
+        }
+        rec.nameCount = nameRecs.size() - rec.firstName;
+        faceRecs.push_back(rec);
+    }
+
+    // open-addressed hash tables, at most half full
+    std::vector<uint32_t> faceTable(2 * faceRecs.size() + 1, 0);
+    for (uint32_t f = 0; f < faceRecs.size(); ++f) {
+        uint32_t i = hashFace(faces[f].path.c_str(), faces[f].index) % faceTable.size();
+        while (faceTable[i] != 0)
+            i = (i + 1) % faceTable.size();
+        faceTable[i] = f + 1;
+    }
+    std::vector<uint32_t> nameTable(2 * nameRecs.size() + 1, 0);
+    for (uint32_t n = 0; n < nameRecs.size(); ++n) {
+        if (nameRecs[n].kind == kIndexStyleName)
+            continue;
+        uint32_t i = hashString(strings.c_str() + nameRecs[n].string) % nameTable.size();
+        while (nameTable[i] != 0)
+            i = (i + 1) % nameTable.size();
+        nameTable[i] = n + 1;
+    }
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, 8);
+    header.version = INDEX_VERSION;
+    header.byteOrder = INDEX_BYTE_ORDER;
+    header.faceCount = faceRecs.size();
+    header.nameCount = nameRecs.size();
+    header.faceSlots = faceTable.size();
+    header.nameSlots = nameTable.size();
+    header.stringsSize = strings.size();
+
+    // write a new file and move it into place, so that other runs
+    // never see a partly-written index
+    char suffix[32];
+    sprintf(suffix, ".%d", (int) getpid());
+    std::string tmpPath = path + suffix;
+    if (!kpse_out_name_ok(path.c_str()) || !kpse_out_name_ok(tmpPath.c_str()))
+        return;
+
+    std::string dir(path, 0, path.rfind('/'));
+    std::string parent(dir, 0, dir.rfind('/'));
+#ifdef WIN32
+    _mkdir(parent.c_str());
+    _mkdir(dir.c_str());
+#else
+    mkdir(parent.c_str(), 0777);
+    mkdir(dir.c_str(), 0777);
+#endif
+    FILE* f = fopen(tmpPath.c_str(), FOPEN_WBIN_MODE);
+    if (f == NULL)
+        return;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    if (faceRecs.size() > 0)
+        ok = ok && fwrite(&faceRecs[0], sizeof(IndexFaceRec), faceRecs.size(), f) == faceRecs.size();
+    if (nameRecs.size() > 0)
+        ok = ok && fwrite(&nameRecs[0], sizeof(IndexNameRec), nameRecs.size(), f) == nameRecs.size();
+    ok = ok && fwrite(&faceTable[0], sizeof(uint32_t), faceTable.size(), f) == faceTable.size();
+    ok = ok && fwrite(&nameTable[0], sizeof(uint32_t), nameTable.size(), f) == nameTable.size();
+    ok = ok && fwrite(strings.data(), 1, strings.size(), f) == strings.size();
+    ok = (fclose(f) == 0) && ok;
+#ifdef WIN32
+    if (ok)
+        remove(path.c_str());
+#endif
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+        remove(tmpPath.c_str());
+    else
+        sIndexDirty = false;
+}
+
 XeTeXFontMgr::NameCollection*
 XeTeXFontMgr_FC::readNames(FcPattern* pat)
 {
-    NameCollection* names = new NameCollection;
-
     char* pathname;
-    if (FcPatternGetString(pat, FC_FILE, 0, (FcChar8**)&pathname) != FcResultMatch)
-        return names;
     int index;
-    if (FcPatternGetInteger(pat, FC_INDEX, 0, &index) != FcResultMatch)
+    if (FcPatternGetString(pat, FC_FILE, 0, (FcChar8**)&pathname) != FcResultMatch
+            || FcPatternGetInteger(pat, FC_INDEX, 0, &index) != FcResultMatch)
+        return new NameCollection;
+
+    IndexedFace* face = lookupFace(pathname, index);
+    if (face != NULL) {
+        NameCollection* names = new NameCollection;
+        names->m_fullNames = face->fullNames;
+        names->m_familyNames = face->familyNames;
+        names->m_styleNames = face->styleNames;
+        names->m_psName = face->psName;
         return names;
+    }
+
+    // not indexed (or the file has changed), so we have to open the font;
+    // a font we can't read is recorded too, so that we don't keep trying
+    int prevPhase = fontloadphase(FONT_PHASE_NAMES);
+    NameCollection* names = readFontNames(pat, pathname, index);
+    fontloadphase(prevPhase);
+    face = recordFace(pathname, index);
+    if (face != NULL) {
+        face->fullNames = names->m_fullNames;
+        face->familyNames = names->m_familyNames;
+        face->styleNames = names->m_styleNames;
+        face->psName = names->m_psName;
+        addFaceNames(*face);
+    }
+
+    return names;
+}
+
+XeTeXFontMgr::NameCollection*
+XeTeXFontMgr_FC::readFontNames(FcPattern* pat, const char* pathname, int index)
+{
+    NameCollection* names = new NameCollection;
 
     FT_Face face;
     if (FT_New_Face(gFreeTypeLibrary, pathname, index, &face) != 0)
         return names;
 
     const char* name = FT_Get_Postscript_Name(face);
-    if (name == NULL)
+    if (name == NULL) {
+        FT_Done_Face(face);
         return names;
+    }
     names->m_psName = name;
 
     // for sfnt containers, we'll read the name table ourselves, not rely on Fontconfig
@@ -189,6 +759,28 @@ XeTeXFontMgr_FC::readNames(FcPattern* pat)
 void
 XeTeXFontMgr_FC::getOpSizeRecAndStyleFlags(Font* theFont)
 {
+    char* pathname;
+    int index;
+    IndexedFace* face = NULL;
+    if (FcPatternGetString(theFont->fontRef, FC_FILE, 0, (FcChar8**)&pathname) == FcResultMatch
+            && FcPatternGetInteger(theFont->fontRef, FC_INDEX, 0, &index) == FcResultMatch)
+        face = lookupFace(pathname, index);
+
+    if (face != NULL && face->hasStyle) {
+        theFont->opSizeInfo.designSize = face->designSize;
+        theFont->opSizeInfo.minSize = face->minSize;
+        theFont->opSizeInfo.maxSize = face->maxSize;
+        theFont->opSizeInfo.subFamilyID = face->subFamilyID;
+        theFont->opSizeInfo.nameCode = face->nameCode;
+        theFont->weight = face->weight;
+        theFont->width = face->width;
+        theFont->slant = face->slant;
+        theFont->isReg = face->isReg;
+        theFont->isBold = face->isBold;
+        theFont->isItalic = face->isItalic;
+        return;
+    }
+
     XeTeXFontMgr::getOpSizeRecAndStyleFlags(theFont);
 
     if (theFont->weight == 0 && theFont->width == 0) {
@@ -202,6 +794,27 @@ XeTeXFontMgr_FC::getOpSizeRecAndStyleFlags(Font* theFont)
         if (FcPatternGetInteger(pat, FC_SLANT, 0, &value) == FcResultMatch)
             theFont->slant = value;
     }
+
+    if (face != NULL) {
+        if (theFont->opSizeInfo.subFamilyID == 0) {
+            // the base class only fills in the whole record for a 'size' range
+            theFont->opSizeInfo.minSize = theFont->opSizeInfo.maxSize = 0.0;
+            theFont->opSizeInfo.nameCode = 0;
+        }
+        face->hasStyle = true;
+        face->designSize = theFont->opSizeInfo.designSize;
+        face->minSize = theFont->opSizeInfo.minSize;
+        face->maxSize = theFont->opSizeInfo.maxSize;
+        face->subFamilyID = theFont->opSizeInfo.subFamilyID;
+        face->nameCode = theFont->opSizeInfo.nameCode;
+        face->weight = theFont->weight;
+        face->width = theFont->width;
+        face->slant = theFont->slant;
+        face->isReg = theFont->isReg;
+        face->isBold = theFont->isBold;
+        face->isItalic = theFont->isItalic;
+        sIndexDirty = true;
+    }
 }
 
 void
@@ -209,23 +822,24 @@ XeTeXFontMgr_FC::cacheFamilyMembers(const std::list<std::string>& familyNames)
 {
     if (familyNames.size() == 0)
         return;
-    for (int f = 0; f < allFonts->nfont; ++f) {
-        FcPattern* pat = allFonts->fonts[f];
+
+    // collect the members of all the families, to add them in Fontconfig's order
+    std::vector<int> members;
+    for (std::list<std::string>::const_iterator j = familyNames.begin(); j != familyNames.end(); ++j) {
+        FamilyToFontsMap::const_iterator i = m_familyToFonts.find(*j);
+        if (i != m_familyToFonts.end())
+            members.insert(members.end(), i->second.begin(), i->second.end());
+    }
+    std::sort(members.begin(), members.end());
+    members.erase(std::unique(members.begin(), members.end()), members.end());
+
+    for (std::vector<int>::const_iterator f = members.begin(); f != members.end(); ++f) {
+        FcPattern* pat = allFonts->fonts[*f];
         if (m_platformRefToFont.find(pat) != m_platformRefToFont.end())
             continue;
-        char* s;
-        for (int i = 0; FcPatternGetString(pat, FC_FAMILY, i, (FcChar8**)&s) == FcResultMatch; ++i) {
-            for (std::list<std::string>::const_iterator j = familyNames.begin(); j != familyNames.end(); ++j) {
-                if (*j == s) {
-                    NameCollection* names = readNames(pat);
-                    addToMaps(pat, names);
-                    delete names;
-                    goto cached;
-                }
-            }
-        }
-    cached:
-        ;
+        NameCollection* names = readNames(pat);
+        addToMaps(pat, names);
+        delete names;
     }
 }
 
@@ -301,10 +915,54 @@ XeTeXFontMgr_FC::searchForHostPlatformFonts(const std::string& name)
 
         if (found || cachedAll)
             break;
+        if (!fontIndexPath().empty()) {
+            searchFontIndex(name, famName);
+            break;
+        }
         cachedAll = true;
     }
 }
 
+void
+XeTeXFontMgr_FC::searchFontIndex(const std::string& name, const std::string& famName)
+{
+    // Fontconfig didn't know the name, so look for it among the names we have
+    // read from the fonts themselves; the first time, this means making sure
+    // that every installed font is in the index
+    if (!indexComplete) {
+        for (int f = 0; f < allFonts->nfont; ++f)
+            delete readNames(allFonts->fonts[f]);
+        if (sIndexDirty)
+            writeFontIndex(allFonts);
+        indexComplete = true;
+    }
+
+    std::set<FaceKey> faces;
+    findFacesByName(name, false, faces);
+    if (famName.length() > 0)
+        findFacesByName(famName, true, faces);
+    if (faces.size() == 0)
+        return;
+
+    // add the fonts in Fontconfig's order, as loading everything would have
+    for (int f = 0; f < allFonts->nfont; ++f) {
+        FcPattern* pat = allFonts->fonts[f];
+        if (m_platformRefToFont.find(pat) != m_platformRefToFont.end())
+            continue;
+        char* pathname;
+        int index;
+        if (FcPatternGetString(pat, FC_FILE, 0, (FcChar8**)&pathname) != FcResultMatch
+                || FcPatternGetInteger(pat, FC_INDEX, 0, &index) != FcResultMatch)
+            continue;
+        if (faces.find(FaceKey(pathname, index)) == faces.end())
+            continue;
+        NameCollection* names = readNames(pat);
+        addToMaps(pat, names);
+        cacheFamilyMembers(names->m_familyNames);
+        delete names;
+    }
+}
+
 void
 XeTeXFontMgr_FC::initialize()
 {
@@ -334,12 +992,27 @@ XeTeXFontMgr_FC::initialize()
     FcObjectSetDestroy(os);
     FcPatternDestroy(pat);
 
+    // index the fonts by the family names Fontconfig gives them
+    for (int f = 0; f < allFonts->nfont; ++f) {
+        char* s;
+        for (int i = 0; FcPatternGetString(allFonts->fonts[f], FC_FAMILY, i, (FcChar8**)&s) == FcResultMatch; ++i) {
+            std::vector<int>& members = m_familyToFonts[s];
+            if (members.size() == 0 || members.back() != f)
+                members.push_back(f);
+        }
+    }
+
     cachedAll = false;
+    indexComplete = false;
+    openFontIndex();
 }
 
 void
 XeTeXFontMgr_FC::terminate()
 {
+    if (sIndexDirty)
+        writeFontIndex(allFonts);
+
     if (macRomanConv != NULL)
         ucnv_close(macRomanConv);
     if (utf16beConv != NULL)
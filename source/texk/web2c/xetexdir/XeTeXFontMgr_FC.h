@@ -53,13 +53,19 @@ protected:
     virtual void                    searchForHostPlatformFonts(const std::string& name);
 
     virtual NameCollection*         readNames(FcPattern* pat);
+    NameCollection*                 readFontNames(FcPattern* pat, const char* pathname, int index);
 
     std::string                     getPlatformFontDesc(PlatformFontRef font) const;
 
     void                            cacheFamilyMembers(const std::list<std::string>& familyNames);
+    void                            searchFontIndex(const std::string& name, const std::string& famName);
 
-    FcFontSet*  allFonts;
-    bool        cachedAll;
+    typedef XeTeXHash::unordered_map<std::string,std::vector<int> >    FamilyToFontsMap;
+
+    FcFontSet*          allFonts;
+    FamilyToFontsMap    m_familyToFonts;    // positions in allFonts of each family's members
+    bool                cachedAll;
+    bool                indexComplete;  // every font in allFonts has been read into the font name index
 };
 
 #endif  /* __XETEX_FONT_MGR_FC_H */
@@ -117,7 +117,9 @@ XeTeXFontMgr_Mac::addFontsToCaches(CFArrayRef fonts)
     NSEnumerator* enumerator = [(NSArray*)fonts objectEnumerator];
     while (id aFont = [enumerator nextObject]) {
         CTFontDescriptorRef fontRef = findFontWithName((CFStringRef)[aFont objectAtIndex: 0], kCTFontNameAttribute);
+        int prevPhase = fontloadphase(FONT_PHASE_NAMES);
         NameCollection* names = readNames(fontRef);
+        fontloadphase(prevPhase);
         addToMaps(fontRef, names);
         delete names;
     }
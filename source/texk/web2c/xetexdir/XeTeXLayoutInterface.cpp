@@ -55,6 +55,40 @@ authorization from the copyright holders.
 #endif
 #include "XeTeXFontMgr.h"
 
+#include <algorithm>
+#include <list>
+#include <map>
+#include <vector>
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+// key is the base direction followed by the UTF-16 text of the word
+typedef std::vector<uint16_t> ShapedWordKey;
+
+struct ShapedWordRec
+{
+    int                 glyphCount;
+    Fixed               width;
+    hb_script_t         script;         // script left in the engine's buffer by the original layout
+    std::vector<char>   glyphInfo;      // locations followed by glyph IDs, as in a native_word node
+    std::vector<Fixed>  glyphAdvances;
+    std::list<const ShapedWordKey*>::iterator lruPos;
+};
+
+// the words, and their keys from the most to the least recently used
+struct ShapedWordCache
+{
+    std::map<ShapedWordKey,ShapedWordRec>   words;
+    std::list<const ShapedWordKey*>         lru;
+};
+
+struct ShapePlanRec
+{
+    hb_segment_properties_t props;  // direction, script and language
+    hb_shape_plan_t*        plan;
+};
+
 struct XeTeXLayoutEngine_rec
 {
     XeTeXFontInst*  font;
@@ -63,29 +97,34 @@ struct XeTeXLayoutEngine_rec
     hb_language_t   language;
     hb_feature_t*   features;
     char**          ShaperList; // the requested shapers
-    char*           shaper;     // the actually used shaper
+    const char*     shaper;     // the actually used shaper
     int             nFeatures;
     uint32_t        rgbValue;
     float           extend;
     float           slant;
     float           embolden;
     hb_buffer_t*    hbBuffer;
+    ShapedWordCache* wordCache;
+    std::vector<ShapePlanRec> shapePlans;
+    bool            useDefaultShapers;  // none of the requested shapers worked
+    int             mergeableWords;     // see canMergeShapedWords(); -1 until checked
 };
 
+#ifdef XETEX_MAC
 /*******************************************************************/
 /* Glyph bounding box cache to speed up \XeTeXuseglyphmetrics mode */
+/* for AAT fonts; OpenType fonts keep their own glyph metrics      */
 /*******************************************************************/
-#include <map>
 
-// key is combined value representing (font_id << 16) + glyph
+// key is (font_id, glyph)
 // value is glyph bounding box in TeX points
-static std::map<uint32_t,GlyphBBox> sGlyphBoxes;
+typedef std::pair<uint32_t,uint32_t> GlyphBBoxKey;
+static std::map<GlyphBBoxKey,GlyphBBox> sGlyphBoxes;
 
 int
-getCachedGlyphBBox(uint16_t fontID, uint16_t glyphID, GlyphBBox* bbox)
+getCachedGlyphBBox(uint32_t fontID, uint32_t glyphID, GlyphBBox* bbox)
 {
-    uint32_t key = ((uint32_t)fontID << 16) + glyphID;
-    std::map<uint32_t,GlyphBBox>::const_iterator i = sGlyphBoxes.find(key);
+    std::map<GlyphBBoxKey,GlyphBBox>::const_iterator i = sGlyphBoxes.find(GlyphBBoxKey(fontID, glyphID));
     if (i == sGlyphBoxes.end()) {
         return 0;
     }
@@ -94,10 +133,90 @@ getCachedGlyphBBox(uint16_t fontID, uint16_t glyphID, GlyphBBox* bbox)
 }
 
 void
-cacheGlyphBBox(uint16_t fontID, uint16_t glyphID, const GlyphBBox* bbox)
+cacheGlyphBBox(uint32_t fontID, uint32_t glyphID, const GlyphBBox* bbox)
 {
-    uint32_t key = ((uint32_t)fontID << 16) + glyphID;
-    sGlyphBoxes[key] = *bbox;
+    sGlyphBoxes[GlyphBBoxKey(fontID, glyphID)] = *bbox;
+}
+/*******************************************************************/
+#endif
+
+/*******************************************************************/
+/* Shaped word cache: the same word is measured over and over in a */
+/* document, and the result only depends on the engine (font,      */
+/* size and features), the base direction and the text itself      */
+/*******************************************************************/
+
+// when the cache is full, the word used least recently makes way for the new
+// one; text longer than a word is hardly ever measured twice, so isn't kept
+#define MAX_CACHED_WORDS 16384
+#define MAX_CACHED_WORD_LENGTH 64
+
+static ShapedWordKey
+shapedWordKey(const uint16_t* text, int length, int baseDirection)
+{
+    ShapedWordKey key(length + 1);
+    key[0] = baseDirection;
+    std::copy(text, text + length, key.begin() + 1);
+    return key;
+}
+
+int
+getCachedShapedWord(XeTeXLayoutEngine engine, const uint16_t* text, int length, int baseDirection, ShapedWord* word)
+{
+    if (engine->wordCache == NULL || length > MAX_CACHED_WORD_LENGTH)
+        return 0;
+
+    ShapedWordCache* cache = engine->wordCache;
+    std::map<ShapedWordKey,ShapedWordRec>::iterator i = cache->words.find(shapedWordKey(text, length, baseDirection));
+    if (i == cache->words.end())
+        return 0;
+
+    const ShapedWordRec& rec = i->second;
+    cache->lru.splice(cache->lru.begin(), cache->lru, rec.lruPos);
+    word->glyphCount = rec.glyphCount;
+    word->width = rec.width;
+    word->glyphInfo = rec.glyphCount > 0 ? &rec.glyphInfo[0] : NULL;
+    word->glyphAdvances = rec.glyphCount > 0 ? &rec.glyphAdvances[0] : NULL;
+    word->script = rec.script;
+
+    // getDefaultDirection() looks at the script of the last word shaped,
+    // so leave the buffer as if we had really done the layout again
+    hb_buffer_set_script(engine->hbBuffer, rec.script);
+
+    return 1;
+}
+
+void
+cacheShapedWord(XeTeXLayoutEngine engine, const uint16_t* text, int length, int baseDirection, const ShapedWord* word)
+{
+    if (length > MAX_CACHED_WORD_LENGTH)
+        return;
+    if (engine->wordCache == NULL)
+        engine->wordCache = new ShapedWordCache;
+
+    ShapedWordCache* cache = engine->wordCache;
+    std::pair<std::map<ShapedWordKey,ShapedWordRec>::iterator,bool> inserted
+        = cache->words.insert(std::make_pair(shapedWordKey(text, length, baseDirection), ShapedWordRec()));
+    ShapedWordRec& rec = inserted.first->second;
+    if (inserted.second) {
+        cache->lru.push_front(&inserted.first->first);
+        rec.lruPos = cache->lru.begin();
+        if (cache->words.size() > MAX_CACHED_WORDS) {
+            ShapedWordKey oldest = *cache->lru.back();
+            cache->lru.pop_back();
+            cache->words.erase(oldest);
+        }
+    } else
+        cache->lru.splice(cache->lru.begin(), cache->lru, rec.lruPos);
+
+    rec.glyphCount = word->glyphCount;
+    rec.width = word->width;
+    rec.script = (hb_script_t) word->script;
+    if (word->glyphCount > 0) {
+        const char* info = (const char*)word->glyphInfo;
+        rec.glyphInfo.assign(info, info + word->glyphCount * native_glyph_info_size);
+        rec.glyphAdvances.assign(word->glyphAdvances, word->glyphAdvances + word->glyphCount);
+    }
 }
 /*******************************************************************/
 
@@ -105,6 +224,19 @@ void
 terminatefontmanager()
 {
     XeTeXFontMgr::Terminate();
+    XeTeXFontFace::writeFaceList();
+}
+
+void
+preloadFontFaces(const char* faceListPath)
+{
+    XeTeXFontFace::startPreloading(faceListPath);
+}
+
+void
+getFontPreloadStats(long* preloaded, long* used)
+{
+    XeTeXFontFace::getPreloadStats(preloaded, used);
 }
 
 XeTeXFont
@@ -139,6 +271,19 @@ createFontFromFile(const char* filename, int index, Fixed pointSize)
     return (XeTeXFont)font;
 }
 
+int
+getFontFileDesignSize(const char* filename, int index, Fixed* designSize)
+{
+    // the face is kept, so that loading the font next won't open the file again
+    XeTeXFontFace* face = XeTeXFontFace::acquire(filename, index);
+    if (face == NULL)
+        return 0;
+    *designSize = D2Fix(face->getDesignSize());
+    face->keep();
+    face->release();
+    return 1;
+}
+
 void
 setFontLayoutDir(XeTeXFont font, int vertical)
 {
@@ -169,6 +314,12 @@ getFullName(PlatformFontRef fontRef)
     return XeTeXFontMgr::GetFontManager()->getFullName(fontRef);
 }
 
+int
+fontManagerStarted()
+{
+    return XeTeXFontMgr::GetFontManager()->isStarted();
+}
+
 double
 getDesignSize(XeTeXFont font)
 {
@@ -193,10 +344,10 @@ deleteFont(XeTeXFont font)
     delete (XeTeXFontInst*)font;
 }
 
-void*
+const void*
 getFontTablePtr(XeTeXFont font, uint32_t tableTag)
 {
-    return const_cast<void*>(((XeTeXFontInst*)font)->getFontTable(tableTag));
+    return ((XeTeXFontInst*)font)->getFontTable(tableTag);
 }
 
 Fixed
@@ -206,76 +357,71 @@ getSlant(XeTeXFont font)
     return D2Fix(tan(-italAngle * M_PI / 180.0));
 }
 
-static unsigned int
-getLargerScriptListTable(XeTeXFont font, hb_tag_t** scriptList)
-{
-    unsigned int rval = 0;
-
-    hb_face_t* face = hb_font_get_face(((XeTeXFontInst*)font)->getHbFont());
-
-    hb_tag_t* scriptListSub = NULL;
-    hb_tag_t* scriptListPos = NULL;
+/* The script, language and feature queries all read the tables of the font's
+   GSUB and GPOS scripts that the face builds the first time it is asked. */
 
-    unsigned int scriptCountSub = hb_ot_layout_table_get_script_tags(face, HB_OT_TAG_GSUB, 0, NULL, NULL);
-    scriptListSub = (hb_tag_t*) xcalloc(scriptCountSub, sizeof(hb_tag_t*));
-    hb_ot_layout_table_get_script_tags(face, HB_OT_TAG_GSUB, 0, &scriptCountSub, scriptListSub);
+static const OTLayoutInfo&
+getLayoutInfo(XeTeXFont font)
+{
+    return ((XeTeXFontInst*)font)->getFace()->getLayoutInfo();
+}
 
-    unsigned int scriptCountPos = hb_ot_layout_table_get_script_tags(face, HB_OT_TAG_GPOS, 0, NULL, NULL);
-    scriptListPos = (hb_tag_t*) xcalloc(scriptCountPos, sizeof(hb_tag_t*));
-    hb_ot_layout_table_get_script_tags(face, HB_OT_TAG_GSUB, 0, &scriptCountPos, scriptListPos);
+// the scripts are listed from GSUB or GPOS, whichever has more of them
+static const std::vector<OTScriptInfo>&
+getLargerScriptList(XeTeXFont font)
+{
+    const OTLayoutInfo& info = getLayoutInfo(font);
+    if (info.scripts[0].size() > info.scripts[1].size())
+        return info.scripts[0];
+    else
+        return info.scripts[1];
+}
 
-    if (scriptCountSub > scriptCountPos) {
-        if (scriptList != NULL)
-            *scriptList = scriptListSub;
-        rval = scriptCountSub;
-    } else {
-        if (scriptList != NULL)
-            *scriptList = scriptListPos;
-        rval = scriptCountPos;
-    }
+static const OTScriptInfo*
+findScript(const std::vector<OTScriptInfo>& scripts, hb_tag_t script)
+{
+    for (std::vector<OTScriptInfo>::const_iterator i = scripts.begin(); i != scripts.end(); ++i)
+        if (i->tag == script)
+            return &*i;
+    return NULL;
+}
 
-    return rval;
+static const std::vector<hb_tag_t>*
+findFeatures(const OTScriptInfo* script, hb_tag_t language)
+{
+    if (script == NULL)
+        return NULL;
+    for (std::vector<OTLanguageInfo>::const_iterator i = script->languages.begin(); i != script->languages.end(); ++i)
+        if (i->tag == language)
+            return &i->features;
+    return language == 0 ? &script->defaultFeatures : NULL;
 }
 
 unsigned int
 countScripts(XeTeXFont font)
 {
-    return getLargerScriptListTable(font, NULL);
+    return getLargerScriptList(font).size();
 }
 
 hb_tag_t
 getIndScript(XeTeXFont font, unsigned int index)
 {
-    hb_tag_t rval = 0;
-
-    hb_tag_t* scriptList;
-
-    unsigned int scriptCount = getLargerScriptListTable(font, &scriptList);
-    if (scriptList != NULL) {
-        if (index < scriptCount)
-            rval = scriptList[index];
-    }
-
-    return rval;
+    const std::vector<OTScriptInfo>& scripts = getLargerScriptList(font);
+    return index < scripts.size() ? scripts[index].tag : 0;
 }
 
+// languages and features are those of GSUB followed by those of GPOS
+
 unsigned int
 countLanguages(XeTeXFont font, hb_tag_t script)
 {
     unsigned int rval = 0;
 
-    hb_face_t* face = hb_font_get_face(((XeTeXFontInst*)font)->getHbFont());
-    hb_tag_t* scriptList;
-
-    unsigned int scriptCount = getLargerScriptListTable(font, &scriptList);
-    if (scriptList != NULL) {
-        for (int i = 0; i < scriptCount; i++) {
-            if (scriptList[i] == script) {
-                rval += hb_ot_layout_script_get_language_tags (face, HB_OT_TAG_GSUB, i, 0, NULL, NULL);
-                rval += hb_ot_layout_script_get_language_tags (face, HB_OT_TAG_GPOS, i, 0, NULL, NULL);
-                break;
-            }
-        }
+    const OTLayoutInfo& info = getLayoutInfo(font);
+    for (int i = 0; i < 2; ++i) {
+        const OTScriptInfo* scriptInfo = findScript(info.scripts[i], script);
+        if (scriptInfo != NULL)
+            rval += scriptInfo->languages.size();
     }
 
     return rval;
@@ -284,44 +430,17 @@ countLanguages(XeTeXFont font, hb_tag_t script)
 hb_tag_t
 getIndLanguage(XeTeXFont font, hb_tag_t script, unsigned int index)
 {
-    hb_tag_t rval = 0;
-
-    hb_face_t* face = hb_font_get_face(((XeTeXFontInst*)font)->getHbFont());
-    hb_tag_t* scriptList;
-
-    unsigned int scriptCount = getLargerScriptListTable(font, &scriptList);
-    if (scriptList != NULL) {
-        for (int i = 0; i < scriptCount; i++) {
-            if (scriptList[i] == script) {
-                unsigned int langCount;
-                hb_tag_t* langList;
-
-                langCount = hb_ot_layout_script_get_language_tags(face, HB_OT_TAG_GSUB, i, 0, NULL, NULL);
-                langList = (hb_tag_t*) xcalloc(langCount, sizeof(hb_tag_t*));
-                hb_ot_layout_script_get_language_tags(face, HB_OT_TAG_GSUB, i, 0, &langCount, langList);
-
-                if (index < langCount) {
-                    rval = langList[index];
-                    break;
-                }
-
-                free(langList);
-
-                langCount = hb_ot_layout_script_get_language_tags(face, HB_OT_TAG_GPOS, i, 0, NULL, NULL);
-                langList = (hb_tag_t*) xcalloc(langCount, sizeof(hb_tag_t*));
-                hb_ot_layout_script_get_language_tags(face, HB_OT_TAG_GPOS, i, 0, &langCount, langList);
-
-                if (index < langCount) {
-                    rval = langList[index];
-                    break;
-                }
-
-                free(langList);
-            }
+    const OTLayoutInfo& info = getLayoutInfo(font);
+    for (int i = 0; i < 2; ++i) {
+        const OTScriptInfo* scriptInfo = findScript(info.scripts[i], script);
+        if (scriptInfo != NULL) {
+            if (index < scriptInfo->languages.size())
+                return scriptInfo->languages[index].tag;
+            index -= scriptInfo->languages.size();
         }
     }
 
-    return rval;
+    return 0;
 }
 
 unsigned int
@@ -329,16 +448,11 @@ countFeatures(XeTeXFont font, hb_tag_t script, hb_tag_t language)
 {
     unsigned int rval = 0;
 
-    hb_face_t* face = hb_font_get_face(((XeTeXFontInst*)font)->getHbFont());
-
+    const OTLayoutInfo& info = getLayoutInfo(font);
     for (int i = 0; i < 2; ++i) {
-        unsigned int scriptIndex, langIndex = 0;
-        hb_tag_t tableTag = i == 0 ? HB_OT_TAG_GSUB : HB_OT_TAG_GPOS;
-        if (hb_ot_layout_table_find_script(face, tableTag, script, &scriptIndex)) {
-            if (hb_ot_layout_script_find_language(face, tableTag, scriptIndex, language, &langIndex) || language == 0) {
-                rval += hb_ot_layout_language_get_feature_tags(face, tableTag, scriptIndex, langIndex, 0, NULL, NULL);
-            }
-        }
+        const std::vector<hb_tag_t>* features = findFeatures(findScript(info.scripts[i], script), language);
+        if (features != NULL)
+            rval += features->size();
     }
 
     return rval;
@@ -347,30 +461,17 @@ countFeatures(XeTeXFont font, hb_tag_t script, hb_tag_t language)
 hb_tag_t
 getIndFeature(XeTeXFont font, hb_tag_t script, hb_tag_t language, unsigned int index)
 {
-    hb_tag_t rval = 0;
-
-    hb_face_t* face = hb_font_get_face(((XeTeXFontInst*)font)->getHbFont());
-
+    const OTLayoutInfo& info = getLayoutInfo(font);
     for (int i = 0; i < 2; ++i) {
-        unsigned int scriptIndex, langIndex = 0;
-        hb_tag_t tableTag = i == 0 ? HB_OT_TAG_GSUB : HB_OT_TAG_GPOS;
-        if (hb_ot_layout_table_find_script(face, tableTag, script, &scriptIndex)) {
-            if (hb_ot_layout_script_find_language(face, tableTag, scriptIndex, language, &langIndex) || language == 0) {
-                unsigned int featCount = hb_ot_layout_language_get_feature_tags(face, tableTag, scriptIndex, langIndex, 0, NULL, NULL);
-                hb_tag_t* featList = (hb_tag_t*) xcalloc(featCount, sizeof(hb_tag_t*));
-                hb_ot_layout_language_get_feature_tags(face, tableTag, scriptIndex, langIndex, 0, &featCount, featList);
-
-                if (index < featCount) {
-                    rval = featList[index];
-                    break;
-                }
-
-                index -= featCount;
-            }
+        const std::vector<hb_tag_t>* features = findFeatures(findScript(info.scripts[i], script), language);
+        if (features != NULL) {
+            if (index < features->size())
+                return (*features)[index];
+            index -= features->size();
         }
     }
 
-    return rval;
+    return 0;
 }
 
 uint32_t
@@ -642,6 +743,9 @@ createLayoutEngine(PlatformFontRef fontRef, XeTeXFont font, hb_tag_t script, cha
     result->slant = slant;
     result->embolden = embolden;
     result->hbBuffer = hb_buffer_create();
+    result->wordCache = NULL;
+    result->useDefaultShapers = false;
+    result->mergeableWords = -1;
 
     // For Graphite fonts treat the language as BCP 47 tag, for OpenType we
     // treat it as a OT language tag for backward compatibility with pre-0.9999
@@ -656,12 +760,43 @@ createLayoutEngine(PlatformFontRef fontRef, XeTeXFont font, hb_tag_t script, cha
     return result;
 }
 
+static void
+clearShapePlans(XeTeXLayoutEngine engine)
+{
+    for (size_t i = 0; i < engine->shapePlans.size(); i++)
+        hb_shape_plan_destroy(engine->shapePlans[i].plan);
+    engine->shapePlans.clear();
+}
+
+// Shape plans only depend on the segment properties once the engine (i.e. face,
+// features and shapers) is fixed, so we keep them for the lifetime of the engine.
+static hb_shape_plan_t*
+getShapePlan(XeTeXLayoutEngine engine, const hb_segment_properties_t* props)
+{
+    for (size_t i = 0; i < engine->shapePlans.size(); i++)
+        if (hb_segment_properties_equal(&engine->shapePlans[i].props, props))
+            return engine->shapePlans[i].plan;
+
+    hb_face_t* hbFace = hb_font_get_face(engine->font->getHbFont());
+    ShapePlanRec rec;
+    rec.props = *props;
+    if (engine->useDefaultShapers)
+        // we don't use _cached here as the cached plan will always fail.
+        rec.plan = hb_shape_plan_create(hbFace, props, engine->features, engine->nFeatures, NULL);
+    else
+        rec.plan = hb_shape_plan_create_cached(hbFace, props, engine->features, engine->nFeatures, engine->ShaperList);
+    engine->shapePlans.push_back(rec);
+
+    return rec.plan;
+}
+
 void
 deleteLayoutEngine(XeTeXLayoutEngine engine)
 {
     hb_buffer_destroy(engine->hbBuffer);
+    delete engine->wordCache;
+    clearShapePlans(engine); // the plans use the font's face, so they go first
     delete engine->font;
-    free(engine->shaper);
 }
 
 #if !HB_VERSION_ATLEAST(2,5,0)
@@ -683,17 +818,27 @@ _get_unicode_funcs(void)
 }
 #endif
 
-int
-layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t count, int32_t max,
-                        bool rightToLeft)
+static hb_unicode_funcs_t*
+getUnicodeFuncs(void)
+{
+#if !HB_VERSION_ATLEAST(2,5,0)
+    static hb_unicode_funcs_t* hbUnicodeFuncs = NULL;
+    if (hbUnicodeFuncs == NULL)
+        hbUnicodeFuncs = _get_unicode_funcs();
+    return hbUnicodeFuncs;
+#else
+    return NULL;
+#endif
+}
+
+// Fill the buffer with the text and work out its segment properties; this is
+// all of the layout that the script left in the engine's buffer depends on.
+static void
+setupBuffer(XeTeXLayoutEngine engine, hb_buffer_t* buffer, uint16_t chars[], int32_t offset, int32_t count, int32_t max,
+                        bool rightToLeft, hb_segment_properties_t* segment_props)
 {
-    bool res;
     hb_script_t script = HB_SCRIPT_INVALID;
     hb_direction_t direction = HB_DIRECTION_LTR;
-    hb_segment_properties_t segment_props;
-    hb_shape_plan_t *shape_plan;
-    hb_font_t* hbFont = engine->font->getHbFont();
-    hb_face_t* hbFace = hb_font_get_face(hbFont);
 
     if (engine->font->getLayoutDirVertical())
         direction = HB_DIRECTION_TTB;
@@ -702,22 +847,31 @@ layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t
 
     script = hb_ot_tag_to_script (engine->script);
 
-    hb_buffer_reset(engine->hbBuffer);
+    hb_buffer_reset(buffer);
 
 #if !HB_VERSION_ATLEAST(2,5,0)
-    static hb_unicode_funcs_t* hbUnicodeFuncs = NULL;
-    if (hbUnicodeFuncs == NULL)
-        hbUnicodeFuncs = _get_unicode_funcs();
-    hb_buffer_set_unicode_funcs(engine->hbBuffer, hbUnicodeFuncs);
+    hb_buffer_set_unicode_funcs(buffer, getUnicodeFuncs());
 #endif
 
-    hb_buffer_add_utf16(engine->hbBuffer, chars, max, offset, count);
-    hb_buffer_set_direction(engine->hbBuffer, direction);
-    hb_buffer_set_script(engine->hbBuffer, script);
-    hb_buffer_set_language(engine->hbBuffer, engine->language);
+    hb_buffer_add_utf16(buffer, chars, max, offset, count);
+    hb_buffer_set_direction(buffer, direction);
+    hb_buffer_set_script(buffer, script);
+    hb_buffer_set_language(buffer, engine->language);
+
+    hb_buffer_guess_segment_properties(buffer);
+    hb_buffer_get_segment_properties(buffer, segment_props);
+}
+
+int
+layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t count, int32_t max,
+                        bool rightToLeft)
+{
+    bool res;
+    hb_segment_properties_t segment_props;
+    hb_shape_plan_t *shape_plan;
+    hb_font_t* hbFont = engine->font->getHbFont();
 
-    hb_buffer_guess_segment_properties(engine->hbBuffer);
-    hb_buffer_get_segment_properties(engine->hbBuffer, &segment_props);
+    setupBuffer(engine, engine->hbBuffer, chars, offset, count, max, rightToLeft, &segment_props);
 
     if (engine->ShaperList == NULL) {
         // HarfBuzz gives graphite2 shaper a priority, so that for hybrid
@@ -730,30 +884,26 @@ layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t
         engine->ShaperList[1] = NULL;
     }
 
-    shape_plan = hb_shape_plan_create_cached(hbFace, &segment_props, engine->features, engine->nFeatures, engine->ShaperList);
+    shape_plan = getShapePlan(engine, &segment_props);
     res = hb_shape_plan_execute(shape_plan, hbFont, engine->hbBuffer, engine->features, engine->nFeatures);
 
+    if (!res && !engine->useDefaultShapers) {
+        // all selected shapers failed, retrying with default, and remembering
+        // to go straight to the default for this engine from now on
+        engine->useDefaultShapers = true;
+        clearShapePlans(engine);
+        shape_plan = getShapePlan(engine, &segment_props);
+        res = hb_shape_plan_execute(shape_plan, hbFont, engine->hbBuffer, engine->features, engine->nFeatures);
+    }
+
     if (res) {
-        engine->shaper = strdup(hb_shape_plan_get_shaper(shape_plan));
+        engine->shaper = hb_shape_plan_get_shaper(shape_plan);
         hb_buffer_set_content_type(engine->hbBuffer, HB_BUFFER_CONTENT_TYPE_GLYPHS);
     } else {
-        // all selected shapers failed, retrying with default
-        // we don't use _cached here as the cached plain will always fail.
-        hb_shape_plan_destroy(shape_plan);
-        shape_plan = hb_shape_plan_create(hbFace, &segment_props, engine->features, engine->nFeatures, NULL);
-        res = hb_shape_plan_execute(shape_plan, hbFont, engine->hbBuffer, engine->features, engine->nFeatures);
-
-        if (res) {
-            engine->shaper = strdup(hb_shape_plan_get_shaper(shape_plan));
-            hb_buffer_set_content_type(engine->hbBuffer, HB_BUFFER_CONTENT_TYPE_GLYPHS);
-        } else {
-            fprintf(stderr, "\nERROR: all shapers failed\n");
-            exit(3);
-        }
+        fprintf(stderr, "\nERROR: all shapers failed\n");
+        exit(3);
     }
 
-    hb_shape_plan_destroy(shape_plan);
-
     int glyphCount = hb_buffer_get_length(engine->hbBuffer);
 
 #ifdef DEBUG
@@ -773,62 +923,257 @@ layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t
     return glyphCount;
 }
 
+// Convert the shaped glyphs in the buffer straight into the layout of a
+// native_word node: glyph locations (relative to *x, *y) and IDs, and the
+// advances; *x and *y are moved on to the end of the run.
+static void
+bufferGlyphLayout(XeTeXLayoutEngine engine, hb_buffer_t* buffer, FixedPoint locations[], uint16_t glyphIDs[],
+                        Fixed advances[], double* x, double* y)
+{
+    int glyphCount = hb_buffer_get_length(buffer);
+    hb_glyph_info_t *hbGlyphs = hb_buffer_get_glyph_infos(buffer, NULL);
+    hb_glyph_position_t *hbPositions = hb_buffer_get_glyph_positions(buffer, NULL);
+    XeTeXFontInst* font = engine->font;
+    bool vertical = font->getLayoutDirVertical();
+    bool transform = engine->extend != 1.0 || engine->slant != 0.0;
+
+    float px, py;
+    float hx = 0, hy = 0;
+
+    for (int i = 0; i < glyphCount; i++) {
+        if (vertical) {
+            px = -font->unitsToPoints(hx + hbPositions[i].y_offset); /* negative is forwards */
+            py =  font->unitsToPoints(hy - hbPositions[i].x_offset);
+            hx += hbPositions[i].y_advance;
+            hy += hbPositions[i].x_advance;
+            advances[i] = D2Fix(font->unitsToPoints(hbPositions[i].y_advance));
+        } else {
+            px =  font->unitsToPoints(hx + hbPositions[i].x_offset);
+            py = -font->unitsToPoints(hy + hbPositions[i].y_offset); /* negative is upwards */
+            hx += hbPositions[i].x_advance;
+            hy += hbPositions[i].y_advance;
+            advances[i] = D2Fix(font->unitsToPoints(hbPositions[i].x_advance));
+        }
+        if (transform)
+            px = px * engine->extend - py * engine->slant;
+
+        glyphIDs[i] = hbGlyphs[i].codepoint;
+        locations[i].x = D2Fix(px + *x);
+        locations[i].y = D2Fix(py + *y);
+    }
+
+    if (vertical) {
+        px = -font->unitsToPoints(hx);
+        py =  font->unitsToPoints(hy);
+    } else {
+        px =  font->unitsToPoints(hx);
+        py = -font->unitsToPoints(hy);
+    }
+    if (transform)
+        px = px * engine->extend - py * engine->slant;
+
+    *x += px;
+    *y += py;
+}
+
 void
-getGlyphs(XeTeXLayoutEngine engine, uint32_t glyphs[])
+getGlyphLayout(XeTeXLayoutEngine engine, FixedPoint* locations, uint16_t* glyphIDs, Fixed* advances, double* x, double* y)
 {
-    int glyphCount = hb_buffer_get_length(engine->hbBuffer);
-    hb_glyph_info_t *hbGlyphs = hb_buffer_get_glyph_infos(engine->hbBuffer, NULL);
+    bufferGlyphLayout(engine, engine->hbBuffer, locations, glyphIDs, advances, x, y);
+}
+
+/*******************************************************************/
+/* Batch shaping: the words that a run of text is broken into are  */
+/* independent of each other, so they can be shaped on a pool of   */
+/* worker threads, each with its own buffer; only the font's       */
+/* FreeType callbacks and the engine's shape plans are shared      */
+/*******************************************************************/
+
+// batches smaller than this are not worth waking the workers for
+#define MIN_BATCH_SIZE 8
+
+int
+getShapingThreads(void)
+{
+#ifndef WIN32
+    // set xetex_shaping_threads in texmf.cnf or the environment to the
+    // number of threads (including the main one) to shape words on
+    static int threads = -1;
+    if (threads < 0) {
+        char* v = kpse_var_value("xetex_shaping_threads");
+        threads = v ? atoi(v) : 0;
+        if (threads < 2)
+            threads = 0;
+        free(v);
+    }
+    return threads;
+#else
+    return 0;
+#endif
+}
 
-    for (int i = 0; i < glyphCount; i++)
-        glyphs[i] = hbGlyphs[i].codepoint;
+bool
+canBatchLayout(XeTeXLayoutEngine engine)
+{
+    // only engines that have already settled on the "ot" shaper; anything
+    // else is left to layoutChars to sort out
+    return engine->shaper != NULL && strcmp(engine->shaper, "ot") == 0 && !engine->useDefaultShapers;
 }
 
 void
-getGlyphAdvances(XeTeXLayoutEngine engine, float advances[])
+prepareLayoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t count, bool rightToLeft)
 {
-    int glyphCount = hb_buffer_get_length(engine->hbBuffer);
-    hb_glyph_position_t *hbPositions = hb_buffer_get_glyph_positions(engine->hbBuffer, NULL);
+    // leave the engine's buffer as layoutChars would, for getDefaultDirection()
+    hb_segment_properties_t segment_props;
+    setupBuffer(engine, engine->hbBuffer, chars, 0, count, count, rightToLeft, &segment_props);
+}
 
-    for (int i = 0; i < glyphCount; i++) {
-        if (engine->font->getLayoutDirVertical())
-            advances[i] = engine->font->unitsToPoints(hbPositions[i].y_advance);
-        else
-            advances[i] = engine->font->unitsToPoints(hbPositions[i].x_advance);
+uint32_t
+getLayoutScript(XeTeXLayoutEngine engine)
+{
+    return hb_buffer_get_script(engine->hbBuffer);
+}
+
+#ifndef WIN32
+static pthread_mutex_t sPlanMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+shapeJob(ShapingJob* job, hb_buffer_t* buffer)
+{
+    XeTeXLayoutEngine engine = job->engine;
+    hb_segment_properties_t segment_props;
+    hb_shape_plan_t *shape_plan;
+
+    setupBuffer(engine, buffer, job->chars, 0, job->count, job->count, job->rightToLeft, &segment_props);
+
+#ifndef WIN32
+    pthread_mutex_lock(&sPlanMutex);
+#endif
+    shape_plan = getShapePlan(engine, &segment_props);
+#ifndef WIN32
+    pthread_mutex_unlock(&sPlanMutex);
+#endif
+
+    // canBatchLayout() only lets through engines using the "ot" shaper, which never fails
+    if (!hb_shape_plan_execute(shape_plan, engine->font->getHbFont(), buffer, engine->features, engine->nFeatures)) {
+        fprintf(stderr, "\nERROR: all shapers failed\n");
+        exit(3);
+    }
+    hb_buffer_set_content_type(buffer, HB_BUFFER_CONTENT_TYPE_GLYPHS);
+
+    int glyphCount = hb_buffer_get_length(buffer);
+    double x = 0, y = 0;
+    job->glyphCount = glyphCount;
+    job->glyphInfo = glyphCount > 0 ? xmalloc(glyphCount * native_glyph_info_size) : NULL;
+    job->advances = (Fixed*) xmalloc((glyphCount + 1) * sizeof(Fixed));
+    FixedPoint* locations = (FixedPoint*) job->glyphInfo;
+    bufferGlyphLayout(engine, buffer, locations, (uint16_t*)(locations + glyphCount), job->advances, &x, &y);
+    job->width = D2Fix(x);
+}
+
+#ifndef WIN32
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  workReady;
+    pthread_cond_t  workDone;
+    unsigned long   generation; // bumped for every batch
+    ShapingJob*     jobs;
+    int             count;
+    int             next;       // the next job to be picked up
+    int             busy;       // threads still working on the batch
+    int             workers;
+} sPool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, NULL, 0, 0, 0, 0 };
+
+// called with the pool mutex held, which is released while shaping
+static void
+runShapingJobs(hb_buffer_t* buffer)
+{
+    ++sPool.busy;
+    while (sPool.next < sPool.count) {
+        ShapingJob* job = &sPool.jobs[sPool.next++];
+        pthread_mutex_unlock(&sPool.mutex);
+        shapeJob(job, buffer);
+        pthread_mutex_lock(&sPool.mutex);
+    }
+    if (--sPool.busy == 0)
+        pthread_cond_signal(&sPool.workDone);
+}
+
+static void*
+shapingWorker(void*)
+{
+    hb_buffer_t* buffer = hb_buffer_create();
+
+    pthread_mutex_lock(&sPool.mutex);
+    for (;;) {
+        unsigned long generation = sPool.generation;
+        while (sPool.generation == generation)
+            pthread_cond_wait(&sPool.workReady, &sPool.mutex);
+        runShapingJobs(buffer);
     }
+
+    return NULL;
 }
+#endif
 
 void
-getGlyphPositions(XeTeXLayoutEngine engine, FloatPoint positions[])
+layoutCharsBatch(ShapingJob* jobs, int count)
 {
-    int glyphCount = hb_buffer_get_length(engine->hbBuffer);
-    hb_glyph_position_t *hbPositions = hb_buffer_get_glyph_positions(engine->hbBuffer, NULL);
+    static hb_buffer_t* buffer = NULL;
+    if (buffer == NULL)
+        buffer = hb_buffer_create();
 
-    float x = 0, y = 0;
+    getUnicodeFuncs(); // set up before any worker needs it
 
-    if (engine->font->getLayoutDirVertical()) {
-        for (int i = 0; i < glyphCount; i++) {
-            positions[i].x = -engine->font->unitsToPoints(x + hbPositions[i].y_offset); /* negative is forwards */
-            positions[i].y =  engine->font->unitsToPoints(y - hbPositions[i].x_offset);
-            x += hbPositions[i].y_advance;
-            y += hbPositions[i].x_advance;
+#ifndef WIN32
+    int threads = getShapingThreads();
+    if (threads > 0 && count >= MIN_BATCH_SIZE) {
+        pthread_mutex_lock(&sPool.mutex);
+        while (sPool.workers < threads - 1) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, shapingWorker, NULL) != 0)
+                break;
+            pthread_detach(thread);
+            ++sPool.workers;
         }
-        positions[glyphCount].x = -engine->font->unitsToPoints(x);
-        positions[glyphCount].y =  engine->font->unitsToPoints(y);
-    } else {
-        for (int i = 0; i < glyphCount; i++) {
-            positions[i].x =  engine->font->unitsToPoints(x + hbPositions[i].x_offset);
-            positions[i].y = -engine->font->unitsToPoints(y + hbPositions[i].y_offset); /* negative is upwards */
-            x += hbPositions[i].x_advance;
-            y += hbPositions[i].y_advance;
+
+        // read the cmaps and advances up front, so the workers find them
+        // there and rarely need to lock a face
+        XeTeXLayoutEngine prevEngine = NULL;
+        for (int i = 0; i < count; i++) {
+            XeTeXLayoutEngine engine = jobs[i].engine;
+            if (engine == prevEngine)
+                continue;
+            XeTeXFontFace* face = engine->font->getFace();
+            face->loadCharMap();
+            face->loadAdvances(engine->font->getLayoutDirVertical());
+            prevEngine = engine;
         }
-        positions[glyphCount].x =  engine->font->unitsToPoints(x);
-        positions[glyphCount].y = -engine->font->unitsToPoints(y);
+
+        FreeTypeLock::setThreaded(true);
+        sPool.jobs = jobs;
+        sPool.count = count;
+        sPool.next = 0;
+        ++sPool.generation;
+        pthread_cond_broadcast(&sPool.workReady);
+
+        runShapingJobs(buffer);
+        while (sPool.busy > 0)
+            pthread_cond_wait(&sPool.workDone, &sPool.mutex);
+
+        sPool.jobs = NULL;
+        sPool.count = 0;
+        FreeTypeLock::setThreaded(false);
+        pthread_mutex_unlock(&sPool.mutex);
+        return;
     }
+#endif
 
-    if (engine->extend != 1.0 || engine->slant != 0.0)
-        for (int i = 0; i <= glyphCount; ++i)
-            positions[i].x = positions[i].x * engine->extend - positions[i].y * engine->slant;
+    for (int i = 0; i < count; i++)
+        shapeJob(&jobs[i], buffer);
 }
+/*******************************************************************/
 
 float
 getPointSize(XeTeXLayoutEngine engine)
@@ -1022,6 +1367,101 @@ usingOpenType(XeTeXLayoutEngine engine)
         return false;
 }
 
+// hb_ot_layout_lookup_collect_glyphs doesn't report glyphs that a lookup only
+// matches as class 0 of a ClassDef, i.e. glyphs that are not in it at all (as
+// the space usually isn't), so we don't try to tell whether a class-based
+// subtable (PairPos, Context or ChainContext format 2) involves the space:
+// a font with any of them can't have its words merged.
+
+static unsigned int
+_read_u16(const uint8_t* data, unsigned int length, unsigned int offset, bool& bad)
+{
+    if (offset > length || length - offset < 2) {
+        bad = true;
+        return 0;
+    }
+    return (data[offset] << 8) | data[offset + 1];
+}
+
+static bool
+_has_class_based_subtables(hb_face_t* face, hb_tag_t tableTag)
+{
+    hb_blob_t* blob = hb_face_reference_table(face, tableTag);
+    unsigned int length;
+    const uint8_t* data = (const uint8_t*) hb_blob_get_data(blob, &length);
+    bool gpos = tableTag == HB_OT_TAG_GPOS;
+    bool found = false, bad = false;
+
+    if (length > 0) {
+        unsigned int lookupList = _read_u16(data, length, 8, bad);
+        unsigned int lookupCount = lookupList != 0 ? _read_u16(data, length, lookupList, bad) : 0;
+        for (unsigned int i = 0; i < lookupCount && !found && !bad; i++) {
+            unsigned int lookup = lookupList + _read_u16(data, length, lookupList + 2 + 2 * i, bad);
+            unsigned int type = _read_u16(data, length, lookup, bad);
+            unsigned int subtableCount = _read_u16(data, length, lookup + 4, bad);
+            for (unsigned int j = 0; j < subtableCount && !found && !bad; j++) {
+                unsigned int st = lookup + _read_u16(data, length, lookup + 6 + 2 * j, bad);
+                unsigned int stType = type;
+                if (type == (gpos ? 9u : 7u)) { // extension
+                    stType = _read_u16(data, length, st + 2, bad);
+                    st += (_read_u16(data, length, st + 4, bad) << 16) | _read_u16(data, length, st + 6, bad);
+                }
+                if (_read_u16(data, length, st, bad) != 2)
+                    continue;
+                found = (gpos && stType == 2) || stType == (gpos ? 7u : 5u) || stType == (gpos ? 8u : 6u);
+            }
+        }
+    }
+
+    hb_blob_destroy(blob);
+    return found || bad;
+}
+
+// Whether words shaped separately can simply be put side by side, with space
+// glyphs in between, rather than shaping the text again as a whole: this is
+// so unless some lookup in the font (or an old-style kern table) may involve
+// the space glyph.
+bool
+canMergeShapedWords(XeTeXLayoutEngine engine)
+{
+    if (engine->shaper == NULL || strcmp("ot", engine->shaper) != 0 || engine->font->getLayoutDirVertical())
+        return false;
+
+    if (engine->mergeableWords < 0) {
+        hb_face_t* face = hb_font_get_face(engine->font->getHbFont());
+        hb_codepoint_t space = engine->font->mapCharToGlyph(' ');
+        bool mergeable = space != 0 && !FT_HAS_KERNING(engine->font->getFace()->getFTFace());
+
+        hb_set_t* glyphs[4];
+        for (int i = 0; i < 4; i++)
+            glyphs[i] = hb_set_create();
+
+        const hb_tag_t tables[] = { HB_OT_TAG_GSUB, HB_OT_TAG_GPOS };
+        for (int t = 0; mergeable && t < 2; t++) {
+            unsigned int lookupCount = hb_ot_layout_table_get_lookup_count(face, tables[t]);
+            for (unsigned int i = 0; mergeable && i < lookupCount; i++) {
+                for (int j = 0; j < 4; j++)
+                    hb_set_clear(glyphs[j]);
+                hb_ot_layout_lookup_collect_glyphs(face, tables[t], i, glyphs[0], glyphs[1], glyphs[2], glyphs[3]);
+                for (int j = 0; j < 4; j++)
+                    if (hb_set_has(glyphs[j], space))
+                        mergeable = false;
+            }
+        }
+
+        for (int i = 0; i < 4; i++)
+            hb_set_destroy(glyphs[i]);
+
+        if (mergeable)
+            mergeable = !_has_class_based_subtables(face, HB_OT_TAG_GSUB)
+                && !_has_class_based_subtables(face, HB_OT_TAG_GPOS);
+
+        engine->mergeableWords = mergeable;
+    }
+
+    return engine->mergeableWords;
+}
+
 bool
 isOpenTypeMathFont(XeTeXLayoutEngine engine)
 {
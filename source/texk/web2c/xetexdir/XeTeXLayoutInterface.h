@@ -59,13 +59,30 @@ extern "C" {
 
 extern char gPrefEngine;
 
-int getCachedGlyphBBox(uint16_t fontID, uint16_t glyphID, GlyphBBox* bbox);
-void cacheGlyphBBox(uint16_t fontID, uint16_t glyphID, const GlyphBBox* bbox);
+#ifdef XETEX_MAC
+int getCachedGlyphBBox(uint32_t fontID, uint32_t glyphID, GlyphBBox* bbox);
+void cacheGlyphBBox(uint32_t fontID, uint32_t glyphID, const GlyphBBox* bbox);
+#endif
+
+typedef struct
+{
+    int             glyphCount;
+    Fixed           width;
+    const void*     glyphInfo;      /* locations followed by glyph IDs, as in a native_word node */
+    const Fixed*    glyphAdvances;
+    uint32_t        script;         /* script left in the engine's buffer by the layout */
+} ShapedWord;
+
+int getCachedShapedWord(XeTeXLayoutEngine engine, const uint16_t* text, int length, int baseDirection, ShapedWord* word);
+void cacheShapedWord(XeTeXLayoutEngine engine, const uint16_t* text, int length, int baseDirection, const ShapedWord* word);
 
 void terminatefontmanager();
+void preloadFontFaces(const char* faceListPath);
+void getFontPreloadStats(long* preloaded, long* used);
 
 XeTeXFont createFont(PlatformFontRef fontRef, Fixed pointSize);
 XeTeXFont createFontFromFile(const char* filename, int index, Fixed pointSize);
+int getFontFileDesignSize(const char* filename, int index, Fixed* designSize);
 
 void setFontLayoutDir(XeTeXFont font, int vertical);
 
@@ -74,6 +91,7 @@ PlatformFontRef findFontByName(const char* name, char* var, double size);
 char getReqEngine();
 void setReqEngine(char reqEngine);
 const char* getFullName(PlatformFontRef fontRef);
+int fontManagerStarted();
 
 char* getFontFilename(XeTeXLayoutEngine engine, uint32_t* index);
 
@@ -81,7 +99,7 @@ double getDesignSize(XeTeXFont font);
 
 void deleteFont(XeTeXFont font);
 
-void* getFontTablePtr(XeTeXFont font, uint32_t tableTag);
+const void* getFontTablePtr(XeTeXFont font, uint32_t tableTag);
 
 Fixed getSlant(XeTeXFont font);
 
@@ -112,9 +130,26 @@ float getEmboldenFactor(XeTeXLayoutEngine engine);
 int layoutChars(XeTeXLayoutEngine engine, uint16_t* chars, int32_t offset, int32_t count, int32_t max,
                         bool rightToLeft);
 
-void getGlyphs(XeTeXLayoutEngine engine, uint32_t* glyphs);
-void getGlyphAdvances(XeTeXLayoutEngine engine, float *advances);
-void getGlyphPositions(XeTeXLayoutEngine engine, FloatPoint* positions);
+void getGlyphLayout(XeTeXLayoutEngine engine, FixedPoint* locations, uint16_t* glyphIDs, Fixed* advances, double* x, double* y);
+
+typedef struct
+{
+    XeTeXLayoutEngine   engine;
+    uint16_t*           chars;
+    int32_t             count;
+    bool                rightToLeft;
+    /* results, filled in by layoutCharsBatch */
+    int                 glyphCount;
+    void*               glyphInfo;  /* locations followed by glyph IDs, as in a native_word node */
+    Fixed*              advances;
+    Fixed               width;
+} ShapingJob;
+
+int getShapingThreads(void);
+bool canBatchLayout(XeTeXLayoutEngine engine);
+void prepareLayoutChars(XeTeXLayoutEngine engine, uint16_t* chars, int32_t count, bool rightToLeft);
+uint32_t getLayoutScript(XeTeXLayoutEngine engine);
+void layoutCharsBatch(ShapingJob* jobs, int count);
 
 float getPointSize(XeTeXLayoutEngine engine);
 
@@ -149,6 +184,7 @@ int findNextGraphiteBreak(void);
 
 bool usingOpenType(XeTeXLayoutEngine engine);
 bool usingGraphite(XeTeXLayoutEngine engine);
+bool canMergeShapedWords(XeTeXLayoutEngine engine);
 bool isOpenTypeMathFont(XeTeXLayoutEngine engine);
 
 bool findGraphiteFeature(XeTeXLayoutEngine engine, const char* s, const char* e, hb_tag_t* f, int* v);
@@ -35,6 +35,7 @@ authorization from the copyright holders.
 
 #include <assert.h>
 #include <algorithm>
+#include <vector>
 
 #include "XeTeXOTMath.h"
 
@@ -42,27 +43,126 @@ authorization from the copyright holders.
 #include "XeTeXLayoutInterface.h"
 #include "XeTeXFontInst.h"
 
-int
-get_ot_math_constant(int f, int n)
+#define MATH_CONSTANT_COUNT (HB_OT_MATH_CONSTANT_RADICAL_DEGREE_BOTTOM_RAISE_PERCENT + 1)
+
+// the size variants of a glyph in one direction, and its assembly if it has one
+struct MathGlyphVariants {
+    std::vector<hb_codepoint_t> glyphs;
+    std::vector<int> advances; // in TeX scaled points
+    bool sorted; // no variant is smaller than the one before it
+    bool assemblyRead;
+    GlyphAssembly* assembly; // shared by all its users, and never freed
+};
+
+// a glyph's math kern at one corner: kern values[i] applies to heights up to
+// heights[i], and the last value to anything above that
+struct MathKern {
+    std::vector<hb_position_t> heights;
+    std::vector<hb_position_t> values;
+};
+
+// what script attachment needs to know about a glyph
+struct MathGlyphInfo {
+    MathGlyphInfo()
+        : italCorrRead(false), accentPosRead(false), heightDepthRead(false), kernsRead(false)
+        , italCorr(0), accentPos(0), height(0.0), depth(0.0)
+    { }
+
+    bool italCorrRead;
+    bool accentPosRead;
+    bool heightDepthRead;
+    bool kernsRead;
+    int italCorr; // in TeX scaled points
+    int accentPos;
+    float height; // in TeX points, as getGlyphHeightDepth gives them
+    float depth;
+    MathKern kerns[4]; // in font units, indexed by hb_ot_math_kern_t
+};
+
+// what we have read from a font's MATH table, all scaled to its size and
+// indexed by font number; the constants are read all at once when the font is
+// loaded (as load_native_font copies them into the fontdimens), the rest for
+// each glyph when it is first asked for
+struct MathFont {
+    int* constants; // except for the ones that are percentages
+    XeTeXHash::unordered_map<unsigned int, MathGlyphVariants> variants; // by glyph and direction
+    XeTeXHash::unordered_map<unsigned int, MathGlyphInfo> glyphs;
+};
+
+static std::vector<MathFont*> mathFonts;
+
+static MathFont*
+get_math_font(int f)
 {
-    hb_ot_math_constant_t constant = (hb_ot_math_constant_t) n;
-    hb_position_t rval = 0;
+    if (f >= (int) mathFonts.size())
+        mathFonts.resize(f + 1, NULL);
 
-    if (fontarea[f] == OTGR_FONT_FLAG) {
+    if (mathFonts[f] == NULL) {
         XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
         hb_font_t* hbFont = font->getHbFont();
-        rval = hb_ot_math_get_constant(hbFont, constant);
-        /* scale according to font size, except the ones that are percentages */
-        switch (constant) {
-            case HB_OT_MATH_CONSTANT_SCRIPT_PERCENT_SCALE_DOWN:
-            case HB_OT_MATH_CONSTANT_SCRIPT_SCRIPT_PERCENT_SCALE_DOWN:
-            case HB_OT_MATH_CONSTANT_RADICAL_DEGREE_BOTTOM_RAISE_PERCENT:
-                break;
-            default:
-                rval = D2Fix(font->unitsToPoints(rval));
-                break;
+        MathFont* mathFont = new MathFont;
+        mathFont->constants = new int[MATH_CONSTANT_COUNT];
+        for (int n = 0; n < MATH_CONSTANT_COUNT; n++) {
+            hb_ot_math_constant_t constant = (hb_ot_math_constant_t) n;
+            hb_position_t rval = hb_ot_math_get_constant(hbFont, constant);
+            /* scale according to font size, except the ones that are percentages */
+            switch (constant) {
+                case HB_OT_MATH_CONSTANT_SCRIPT_PERCENT_SCALE_DOWN:
+                case HB_OT_MATH_CONSTANT_SCRIPT_SCRIPT_PERCENT_SCALE_DOWN:
+                case HB_OT_MATH_CONSTANT_RADICAL_DEGREE_BOTTOM_RAISE_PERCENT:
+                    break;
+                default:
+                    rval = D2Fix(font->unitsToPoints(rval));
+                    break;
+            }
+            mathFont->constants[n] = rval;
         }
+        mathFonts[f] = mathFont;
     }
+
+    return mathFonts[f];
+}
+
+static MathGlyphVariants&
+get_math_variants(int f, int g, int horiz)
+{
+    MathFont* mathFont = get_math_font(f);
+    unsigned int key = ((unsigned int) g << 1) | (horiz ? 1 : 0);
+    XeTeXHash::unordered_map<unsigned int, MathGlyphVariants>::iterator i = mathFont->variants.find(key);
+    if (i != mathFont->variants.end())
+        return i->second;
+
+    MathGlyphVariants& v = mathFont->variants[key];
+    XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
+    hb_font_t* hbFont = font->getHbFont();
+    hb_direction_t dir = horiz ? HB_DIRECTION_RTL : HB_DIRECTION_TTB;
+    unsigned int count = hb_ot_math_get_glyph_variants(hbFont, g, dir, 0, NULL, NULL);
+
+    v.sorted = true;
+    if (count > 0) {
+        std::vector<hb_ot_math_glyph_variant_t> variants(count);
+        hb_ot_math_get_glyph_variants(hbFont, g, dir, 0, &count, &variants[0]);
+        for (unsigned int n = 0; n < count; n++) {
+            v.glyphs.push_back(variants[n].glyph);
+            v.advances.push_back(D2Fix(font->unitsToPoints(variants[n].advance)));
+            if (n > 0 && v.advances[n] < v.advances[n - 1])
+                v.sorted = false;
+        }
+    }
+    v.assemblyRead = false;
+    v.assembly = NULL;
+
+    return v;
+}
+
+int
+get_ot_math_constant(int f, int n)
+{
+    int rval = 0;
+
+    if (fontarea[f] == OTGR_FONT_FLAG && n >= 0 && n < MATH_CONSTANT_COUNT)
+        rval = get_math_font(f)->constants[n];
+
     return rval;
 }
 
@@ -181,6 +281,12 @@ get_native_mathex_param(int f, int n)
     return rval;
 }
 
+static MathGlyphInfo&
+get_math_glyph(int f, int g)
+{
+    return get_math_font(f)->glyphs[g];
+}
+
 int
 get_ot_math_variant(int f, int g, int v, integer* adv, int horiz)
 {
@@ -188,20 +294,53 @@ get_ot_math_variant(int f, int g, int v, integer* adv, int horiz)
     *adv = -1;
 
     if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
-        hb_font_t* hbFont = font->getHbFont();
-        hb_ot_math_glyph_variant_t variant[1];
-        unsigned int count = 1;
-        hb_ot_math_get_glyph_variants(hbFont, g, horiz ? HB_DIRECTION_RTL : HB_DIRECTION_TTB, v, &count, variant);
-        if (count > 0) {
-            rval = variant->glyph;
-            *adv = D2Fix(font->unitsToPoints(variant->advance));
+        const MathGlyphVariants& variants = get_math_variants(f, g, horiz);
+        if (v >= 0 && v < (int) variants.glyphs.size()) {
+            rval = variants.glyphs[v];
+            *adv = variants.advances[v];
         }
     }
 
     return rval;
 }
 
+int
+get_ot_math_variant_for_size(int f, int g, integer size, integer* adv, int horiz)
+{
+    /* the variant var_delimiter would find by trying them in turn: the first
+       one that is at least |size| and larger than all those before it, or else
+       the (first) largest; |*adv| is its size, or 0 if there is none */
+    hb_codepoint_t rval = g;
+    *adv = 0;
+
+    if (fontarea[f] == OTGR_FONT_FLAG) {
+        const MathGlyphVariants& variants = get_math_variants(f, g, horiz);
+        const std::vector<int>& advances = variants.advances;
+        int count = advances.size();
+        int best = -1;
+        if (variants.sorted) {
+            int needed = std::max<int>(size, 1);
+            int n = std::lower_bound(advances.begin(), advances.end(), needed) - advances.begin();
+            if (n < count)
+                best = n;
+            else if (count > 0 && advances[count - 1] > 0)
+                best = std::lower_bound(advances.begin(), advances.end(), advances[count - 1]) - advances.begin();
+        } else {
+            for (int n = 0; n < count; n++)
+                if (advances[n] > (best < 0 ? 0 : advances[best])) {
+                    best = n;
+                    if (advances[n] >= size)
+                        break;
+                }
+        }
+        if (best >= 0) {
+            rval = variants.glyphs[best];
+            *adv = advances[best];
+        }
+    }
+
+    return rval;
+}
 
 void*
 get_ot_assembly_ptr(int f, int g, int horiz)
@@ -209,17 +348,22 @@ get_ot_assembly_ptr(int f, int g, int horiz)
     void*   rval = NULL;
 
     if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
-        hb_font_t* hbFont = font->getHbFont();
-
-        unsigned int count = hb_ot_math_get_glyph_assembly(hbFont, g, horiz ? HB_DIRECTION_RTL : HB_DIRECTION_TTB, 0, NULL, NULL, NULL);
-        if (count > 0) {
-            GlyphAssembly* a = (GlyphAssembly*) xmalloc(sizeof(GlyphAssembly));
-            a->count = count;
-            a->parts = (hb_ot_math_glyph_part_t*) xmalloc(count * sizeof(hb_ot_math_glyph_part_t));
-            hb_ot_math_get_glyph_assembly(hbFont, g, horiz ? HB_DIRECTION_RTL : HB_DIRECTION_TTB, 0, &a->count, a->parts, NULL);
-            rval = (void*) a;
+        MathGlyphVariants& variants = get_math_variants(f, g, horiz);
+        if (!variants.assemblyRead) {
+            XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
+            hb_font_t* hbFont = font->getHbFont();
+
+            unsigned int count = hb_ot_math_get_glyph_assembly(hbFont, g, horiz ? HB_DIRECTION_RTL : HB_DIRECTION_TTB, 0, NULL, NULL, NULL);
+            if (count > 0) {
+                GlyphAssembly* a = (GlyphAssembly*) xmalloc(sizeof(GlyphAssembly));
+                a->count = count;
+                a->parts = (hb_ot_math_glyph_part_t*) xmalloc(count * sizeof(hb_ot_math_glyph_part_t));
+                hb_ot_math_get_glyph_assembly(hbFont, g, horiz ? HB_DIRECTION_RTL : HB_DIRECTION_TTB, 0, &a->count, a->parts, NULL);
+                variants.assembly = a;
+            }
+            variants.assemblyRead = true;
         }
+        rval = (void*) variants.assembly;
     }
 
     return rval;
@@ -228,10 +372,7 @@ get_ot_assembly_ptr(int f, int g, int horiz)
 void
 free_ot_assembly(GlyphAssembly* a)
 {
-    if (!a)
-        return;
-    free (a->parts);
-    free (a);
+    /* nothing to do: assemblies are kept with their font */
 }
 
 int
@@ -240,10 +381,14 @@ get_ot_math_ital_corr(int f, int g)
     hb_position_t rval = 0;
 
     if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
-        hb_font_t* hbFont = font->getHbFont();
-        rval = hb_ot_math_get_glyph_italics_correction(hbFont, g);
-        rval = D2Fix(font->unitsToPoints(rval));
+        MathGlyphInfo& info = get_math_glyph(f, g);
+        if (!info.italCorrRead) {
+            XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
+            hb_font_t* hbFont = font->getHbFont();
+            info.italCorr = D2Fix(font->unitsToPoints(hb_ot_math_get_glyph_italics_correction(hbFont, g)));
+            info.italCorrRead = true;
+        }
+        rval = info.italCorr;
     }
 
     return rval;
@@ -255,10 +400,14 @@ get_ot_math_accent_pos(int f, int g)
     hb_position_t rval = 0x7fffffffUL;
 
     if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
-        hb_font_t* hbFont = font->getHbFont();
-        rval = hb_ot_math_get_glyph_top_accent_attachment(hbFont, g);
-        rval = D2Fix(font->unitsToPoints(rval));
+        MathGlyphInfo& info = get_math_glyph(f, g);
+        if (!info.accentPosRead) {
+            XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
+            hb_font_t* hbFont = font->getHbFont();
+            info.accentPos = D2Fix(font->unitsToPoints(hb_ot_math_get_glyph_top_accent_attachment(hbFont, g)));
+            info.accentPosRead = true;
+        }
+        rval = info.accentPos;
     }
 
     return rval;
@@ -287,21 +436,60 @@ getMathKernAt(int f, int g, hb_ot_math_kern_t side, int height)
     if (fontarea[f] == OTGR_FONT_FLAG) {
         XeTeXFontInst* font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
         hb_font_t* hbFont = font->getHbFont();
+#if HB_VERSION_ATLEAST(3,4,0)
+        MathGlyphInfo& info = get_math_glyph(f, g);
+        if (!info.kernsRead) {
+            for (int corner = 0; corner < 4; corner++) {
+                hb_ot_math_kern_t kern = (hb_ot_math_kern_t) corner;
+                unsigned int count = hb_ot_math_get_glyph_kernings(hbFont, g, kern, 0, NULL, NULL);
+                if (count > 0) {
+                    std::vector<hb_ot_math_kern_entry_t> entries(count);
+                    hb_ot_math_get_glyph_kernings(hbFont, g, kern, 0, &count, &entries[0]);
+                    for (unsigned int i = 0; i < count; i++) {
+                        info.kerns[corner].heights.push_back(entries[i].max_correction_height);
+                        info.kerns[corner].values.push_back(entries[i].kern_value);
+                    }
+                }
+            }
+            info.kernsRead = true;
+        }
+        /* as in hb_ot_math_get_glyph_kerning, the first step whose top is
+           not below |height| */
+        const MathKern& kern = info.kerns[side];
+        if (!kern.values.empty()) {
+            size_t i = std::lower_bound(kern.heights.begin(), kern.heights.end() - 1, height) - kern.heights.begin();
+            rval = kern.values[i];
+        }
+#else
         rval = hb_ot_math_get_glyph_kerning(hbFont, g, side, height);
+#endif
     }
 
     return rval;
 }
 
+static void
+get_glyph_height_depth(int f, int g, float* ht, float* dp)
+{
+    MathGlyphInfo& info = get_math_glyph(f, g);
+    if (!info.heightDepthRead) {
+        XeTeXLayoutEngine engine = (XeTeXLayoutEngine)fontlayoutengine[f];
+        getGlyphHeightDepth(engine, g, &info.height, &info.depth);
+        info.heightDepthRead = true;
+    }
+    if (ht)
+        *ht = info.height;
+    if (dp)
+        *dp = info.depth;
+}
+
 static float
 glyph_height(int f, int g)
 {
     float rval = 0.0;
 
-    if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXLayoutEngine engine = (XeTeXLayoutEngine)fontlayoutengine[f];
-        getGlyphHeightDepth(engine, g, &rval, NULL);
-    }
+    if (fontarea[f] == OTGR_FONT_FLAG)
+        get_glyph_height_depth(f, g, &rval, NULL);
 
     return rval;
 }
@@ -311,10 +499,8 @@ glyph_depth(int f, int g)
 {
     float rval = 0.0;
 
-    if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXLayoutEngine engine = (XeTeXLayoutEngine)fontlayoutengine[f];
-        getGlyphHeightDepth(engine, g, NULL, &rval);
-    }
+    if (fontarea[f] == OTGR_FONT_FLAG)
+        get_glyph_height_depth(f, g, NULL, &rval);
 
     return rval;
 }
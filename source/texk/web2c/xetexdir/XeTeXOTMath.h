@@ -48,6 +48,7 @@ extern "C" {
     int get_native_mathex_param(int f, int n);
     int get_ot_math_constant(int f, int n);
     int get_ot_math_variant(int f, int g, int v, integer* adv, int horiz);
+    int get_ot_math_variant_for_size(int f, int g, integer size, integer* adv, int horiz);
     void* get_ot_assembly_ptr(int f, int g, int horiz);
     void free_ot_assembly(GlyphAssembly* a);
     int get_ot_math_ital_corr(int f, int g);
@@ -473,29 +473,41 @@ static void die(const_string s, int i)
     exit(3);
 }
 
-static UBreakIterator* brkIter = NULL;
-static int brkLocaleStrNum = 0;
+/* Line break iterators are kept for the last few locales used, most recent
+   first, so that going back and forth between languages does not have ICU
+   load the break rules and dictionaries again each time. */
 
-void
-linebreakstart(int f, integer localeStrNum, uint16_t* text, integer textLength)
+#define BRK_ITER_POOL_SIZE 8
+
+typedef struct {
+    char* locale;
+    UBreakIterator* iter;
+} brkiterator;
+
+static brkiterator brkIterPool[BRK_ITER_POOL_SIZE];
+static int brkIterCount = 0;
+static long brkItersOpened = 0;
+static UBreakIterator* brkIter = NULL; /* the one in use, if not Graphite */
+
+static UBreakIterator*
+get_break_iterator(char* locale)
 {
+    /* |locale| is taken over by the pool, or freed */
+    brkiterator entry;
     UErrorCode status = U_ZERO_ERROR;
-    char* locale = (char*)gettexstring(localeStrNum);
-
-    if (fontarea[f] == OTGR_FONT_FLAG && strcmp(locale, "G") == 0) {
-        XeTeXLayoutEngine engine = (XeTeXLayoutEngine) fontlayoutengine[f];
-        if (initGraphiteBreaking(engine, text, textLength))
-            /* user asked for Graphite line breaking and the font supports it */
-            return;
-    }
+    int i;
 
-    if ((localeStrNum != brkLocaleStrNum) && (brkIter != NULL)) {
-        ubrk_close(brkIter);
-        brkIter = NULL;
-    }
+    for (i = 0; i < brkIterCount; ++i)
+        if (strcmp(brkIterPool[i].locale, locale) == 0)
+            break;
 
-    if (brkIter == NULL) {
-        brkIter = ubrk_open(UBRK_LINE, locale, NULL, 0, &status);
+    if (i < brkIterCount) {
+        free(locale);
+        entry = brkIterPool[i];
+    } else {
+        entry.locale = locale;
+        entry.iter = ubrk_open(UBRK_LINE, locale, NULL, 0, &status);
+        ++brkItersOpened;
         if (U_FAILURE(status)) {
             begindiagnostic();
             printnl('E');
@@ -505,19 +517,49 @@ linebreakstart(int f, integer localeStrNum, uint16_t* text, integer textLength)
             printcstring(locale);
             printcstring("'; trying default locale `en_us'.");
             enddiagnostic(1);
-            if (brkIter != NULL)
-                ubrk_close(brkIter);
+            if (entry.iter != NULL)
+                ubrk_close(entry.iter);
             status = U_ZERO_ERROR;
-            brkIter = ubrk_open(UBRK_LINE, "en_us", NULL, 0, &status);
+            entry.iter = ubrk_open(UBRK_LINE, "en_us", NULL, 0, &status);
+            ++brkItersOpened;
         }
-        free(locale);
-        brkLocaleStrNum = localeStrNum;
+        if (entry.iter == NULL) {
+            die("! failed to create linebreak iterator, status=%d", (int)status);
+        }
+        if (brkIterCount < BRK_ITER_POOL_SIZE)
+            ++brkIterCount;
+        else {
+            /* drop the one used least recently */
+            free(brkIterPool[i - 1].locale);
+            ubrk_close(brkIterPool[i - 1].iter);
+        }
+        i = brkIterCount - 1;
     }
 
-    if (brkIter == NULL) {
-        die("! failed to create linebreak iterator, status=%d", (int)status);
+    /* move it to the front */
+    memmove(&brkIterPool[1], &brkIterPool[0], i * sizeof(brkiterator));
+    brkIterPool[0] = entry;
+
+    return entry.iter;
+}
+
+void
+linebreakstart(int f, integer localeStrNum, uint16_t* text, integer textLength)
+{
+    UErrorCode status = U_ZERO_ERROR;
+    char* locale = (char*)gettexstring(localeStrNum);
+
+    if (fontarea[f] == OTGR_FONT_FLAG && strcmp(locale, "G") == 0) {
+        XeTeXLayoutEngine engine = (XeTeXLayoutEngine) fontlayoutengine[f];
+        if (initGraphiteBreaking(engine, text, textLength)) {
+            /* user asked for Graphite line breaking and the font supports it */
+            free(locale);
+            brkIter = NULL;
+            return;
+        }
     }
 
+    brkIter = get_break_iterator(locale);
     ubrk_setText(brkIter, (UChar*) text, textLength, &status);
 }
 
@@ -601,11 +643,165 @@ printchars(const unsigned short* str, int len)
 #define UTF16_NATIVE kForm_UTF16LE
 #endif
 
+/* Where the time goes when a native font is loaded: with \XeTeXtracingfonts
+   set to 3 or more, each load is timed (wall-clock and CPU) phase by phase,
+   and reportfontloadtimes lists the fonts at the end of the run, slowest
+   first. Loads that fail, or that give a font already loaded, are listed
+   too, as a lookup that finds nothing can be the slowest of all. */
+
+static const char* fontPhaseNames[FONT_PHASE_COUNT] = {
+    "lookup", "names", "open", "harfbuzz", "features", "mapping", "metrics", "math"
+};
+
+typedef struct fontloadtiming {
+    char* name;
+    integer f; /* 0 if the font was not loaded */
+    int shared; /* the font was one loaded before */
+    integer firstNewFont; /* the number a new font would get */
+    double wall[FONT_PHASE_COUNT];
+    double cpu[FONT_PHASE_COUNT];
+    double totalWall;
+} fontloadtiming;
+
+static fontloadtiming* fontLoadTimes = NULL;
+static int fontLoadTimesCount = 0;
+static int fontLoadTimesSize = 0;
+
+static fontloadtiming pendingTiming; /* the load in progress, if timingFontLoad */
+static int timingFontLoad = 0;
+static int fontLoadPhase = -1;
+static double phaseWallStart;
+static clock_t phaseCpuStart;
+
+static double
+wall_clock_seconds(void)
+{
+    integer secs, micros;
+    get_seconds_and_micros(&secs, &micros);
+    return secs + micros / 1000000.0;
+}
+
+int
+fontloadphase(int phase)
+{
+    /* charges the time since the last change of phase to the current one and
+       moves on to |phase| (or stops the clock, if it is negative); returns
+       the previous phase, for nested phases to go back to */
+    int prevPhase = fontLoadPhase;
+    double now;
+    clock_t cpuNow;
+
+    if (!timingFontLoad)
+        return -1;
+
+    now = wall_clock_seconds();
+    cpuNow = clock();
+    if (prevPhase >= 0) {
+        pendingTiming.wall[prevPhase] += now - phaseWallStart;
+        pendingTiming.cpu[prevPhase] += (double) (cpuNow - phaseCpuStart) / CLOCKS_PER_SEC;
+    }
+    phaseWallStart = now;
+    phaseCpuStart = cpuNow;
+    fontLoadPhase = phase;
+
+    return prevPhase;
+}
+
+static void
+start_font_load_timing(const char* name)
+{
+    free(pendingTiming.name);
+    memset(&pendingTiming, 0, sizeof(pendingTiming));
+    timingFontLoad = 0;
+    fontLoadPhase = -1;
+    if (gettracingfontsstate() > 2) {
+        pendingTiming.name = xstrdup(name);
+        pendingTiming.firstNewFont = fontptr + 1;
+        timingFontLoad = 1;
+        fontloadphase(FONT_PHASE_LOOKUP);
+    }
+}
+
+void
+startfontmathtiming(void)
+{
+    fontloadphase(FONT_PHASE_MATH);
+}
+
+void
+finishfontloadtiming(integer f)
+{
+    /* called by load_native_font when it is done: |f| is the font it
+       returns, which is |null_font| if it failed */
+    int i;
+
+    if (!timingFontLoad)
+        return;
+    fontloadphase(-1);
+    timingFontLoad = 0;
+
+    if (fontLoadTimesCount == fontLoadTimesSize) {
+        fontLoadTimesSize += 32;
+        fontLoadTimes = (fontloadtiming*) xrealloc(fontLoadTimes, fontLoadTimesSize * sizeof(fontloadtiming));
+    }
+    pendingTiming.f = f;
+    pendingTiming.shared = f != 0 && f < pendingTiming.firstNewFont;
+    for (i = 0; i < FONT_PHASE_COUNT; ++i)
+        pendingTiming.totalWall += pendingTiming.wall[i];
+    fontLoadTimes[fontLoadTimesCount++] = pendingTiming;
+    pendingTiming.name = NULL;
+}
+
+static int
+compare_font_load_times(const void* a, const void* b)
+{
+    double ta = ((const fontloadtiming*) a)->totalWall;
+    double tb = ((const fontloadtiming*) b)->totalWall;
+    return (ta < tb) - (ta > tb);
+}
+
+void
+reportfontloadtimes(void)
+{
+    int i, j;
+    double wall[FONT_PHASE_COUNT], cpu[FONT_PHASE_COUNT];
+
+    if (fontLoadTimesCount == 0)
+        return;
+
+    qsort(fontLoadTimes, fontLoadTimesCount, sizeof(fontloadtiming), compare_font_load_times);
+    memset(wall, 0, sizeof(wall));
+    memset(cpu, 0, sizeof(cpu));
+
+    fprintf(logfile, "\nNative font loading times (wall/CPU seconds), slowest first:\n");
+    for (i = 0; i < fontLoadTimesCount; ++i) {
+        fontloadtiming* t = &fontLoadTimes[i];
+        if (t->f == 0)
+            fprintf(logfile, " %.3f not found \"%s\":", t->totalWall, t->name);
+        else
+            fprintf(logfile, " %.3f font %d%s \"%s\":", t->totalWall, (int) t->f,
+                    t->shared ? " (shared)" : "", t->name);
+        for (j = 0; j < FONT_PHASE_COUNT; ++j) {
+            if (t->wall[j] > 0.0 || t->cpu[j] > 0.0)
+                fprintf(logfile, " %s %.3f/%.3f", fontPhaseNames[j], t->wall[j], t->cpu[j]);
+            wall[j] += t->wall[j];
+            cpu[j] += t->cpu[j];
+        }
+        fprintf(logfile, "\n");
+    }
+
+    fprintf(logfile, " total for %d fonts:", fontLoadTimesCount);
+    for (j = 0; j < FONT_PHASE_COUNT; ++j)
+        fprintf(logfile, " %s %.3f/%.3f", fontPhaseNames[j], wall[j], cpu[j]);
+    fprintf(logfile, "\n");
+}
+
 static void*
 load_mapping_file(const char* s, const char* e, char byteMapping)
 {
     char* mapPath;
     TECkit_Converter cnv = 0;
+    int prevPhase = fontloadphase(FONT_PHASE_MAPPING);
     char* buffer = (char*) xmalloc(e - s + 5);
     strncpy(buffer, s, e - s);
     buffer[e - s] = 0;
@@ -646,6 +842,7 @@ load_mapping_file(const char* s, const char* e, char byteMapping)
     }
 
     free(buffer);
+    fontloadphase(prevPhase);
 
     return cnv;
 }
@@ -1140,6 +1337,99 @@ splitFontName(char* name, char** var, char** feat, char** end, int* index)
         *var = *feat;
 }
 
+/* counts of the two kinds of native font request, for the statistics */
+static long fontsFoundByName = 0;
+static long fontsFoundByFile = 0;
+
+/* Native fonts that have been loaded, keyed by the font file (or platform font)
+   they came from, the requested size and the variant and feature strings;
+   when the same font is asked for again (as fontspec and NFSS tend to do),
+   findnativefont returns it through loadedfontalias without loading anything. */
+
+typedef struct loadedfont {
+    struct loadedfont* next;
+    char* key;
+    integer f;
+} loadedfont;
+
+#define LOADED_FONT_BUCKETS 509
+static loadedfont* loadedFonts[LOADED_FONT_BUCKETS];
+static char* pendingFontKey = NULL; /* key of the font being loaded */
+static long fontsShared = 0;
+
+static unsigned int
+hash_font_key(const char* key)
+{
+    unsigned int h = 0;
+    while (*key)
+        h = h * 31 + (unsigned char) *key++;
+    return h % LOADED_FONT_BUCKETS;
+}
+
+static char*
+native_font_key(const char* source, int index, integer scaled_size, const char* varString, const char* featString)
+{
+    /* features are compared as loadOTfont reads them: ignoring leading
+       whitespace and empty options, and whichever separators are used */
+    int len = strlen(source) + (varString ? strlen(varString) : 0) + (featString ? strlen(featString) : 0) + 64;
+    char* key = (char*) xmalloc(len);
+    char* cp = key + sprintf(key, "%s\t%d\t%d\t%s\t", source, index, (int) scaled_size, varString ? varString : "");
+    if (featString != NULL) {
+        const char* cp1 = featString;
+        while (*cp1) {
+            const char* cp2;
+            if ((*cp1 == ':') || (*cp1 == ';') || (*cp1 == ','))
+                ++cp1;
+            while ((*cp1 == ' ') || (*cp1 == '\t'))
+                ++cp1;
+            cp2 = cp1;
+            while (*cp2 && (*cp2 != ':') && (*cp2 != ';') && (*cp2 != ','))
+                ++cp2;
+            if (cp2 > cp1) {
+                memcpy(cp, cp1, cp2 - cp1);
+                cp += cp2 - cp1;
+                *cp++ = ';';
+            }
+            cp1 = cp2;
+        }
+    }
+    *cp = 0;
+    return key;
+}
+
+/* returns the font already loaded with this key, if any, or else keeps
+   the key for remembernativefont */
+static integer
+find_loaded_native_font(char* key)
+{
+    loadedfont* rec;
+    for (rec = loadedFonts[hash_font_key(key)]; rec != NULL; rec = rec->next)
+        if (strcmp(rec->key, key) == 0) {
+            free(key);
+            ++fontsShared;
+            return rec->f;
+        }
+    free(pendingFontKey);
+    pendingFontKey = key;
+    return 0;
+}
+
+void
+remembernativefont(integer f)
+{
+    /* called by load_native_font when the font that findnativefont
+       last looked up has been made font |f| */
+    if (pendingFontKey != NULL) {
+        unsigned int h = hash_font_key(pendingFontKey);
+        loadedfont* rec = (loadedfont*) xmalloc(sizeof(loadedfont));
+        rec->key = pendingFontKey;
+        rec->f = f;
+        rec->next = loadedFonts[h];
+        loadedFonts[h] = rec;
+        pendingFontKey = NULL;
+    }
+}
+
 void*
 findnativefont(unsigned char* uname, integer scaled_size)
     /* scaled_size here is in TeX points, or is a negative integer for 'scaled' */
@@ -1159,6 +1449,10 @@ findnativefont(unsigned char* uname, integer scaled_size)
     loadedfontmapping = NULL;
     loadedfontflags = 0;
     loadedfontletterspace = 0;
+    loadedfontalias = 0;
+    free(pendingFontKey);
+    pendingFontKey = NULL;
+    start_font_load_timing(name);
 
     splitFontName(name, &var, &feat, &end, &index);
     nameString = (char*) xmalloc(var - name + 1);
@@ -1179,23 +1473,25 @@ findnativefont(unsigned char* uname, integer scaled_size)
 
     // check for "[filename]" form, don't search maps in this case
     if (nameString[0] == '[') {
+        ++fontsFoundByFile;
         char* path = kpse_find_file(nameString + 1, kpse_opentype_format, 0);
         if (path == NULL)
             path = kpse_find_file(nameString + 1, kpse_truetype_format, 0);
         if (path == NULL)
             path = kpse_find_file(nameString + 1, kpse_type1_format, 0);
-        if (path != NULL) {
+        if (path != NULL)
+            loadedfontalias = find_loaded_native_font(native_font_key(path, index, scaled_size, varString, featString));
+        if (path != NULL && loadedfontalias == 0) {
             if (scaled_size < 0) {
-                font = createFontFromFile(path, index, 655360L);
-                if (font != NULL) {
-                    Fixed dsize = D2Fix(getDesignSize(font));
+                Fixed dsize;
+                if (getFontFileDesignSize(path, index, &dsize)) {
                     if (scaled_size == -1000)
                         scaled_size = dsize;
                     else
                         scaled_size = zxnoverd(dsize, -scaled_size, 1000);
-                    deleteFont(font);
                 }
             }
+            fontloadphase(FONT_PHASE_OPEN);
             font = createFontFromFile(path, index, scaled_size);
             if (font != NULL) {
                 loadedfontdesignsize = D2Fix(getDesignSize(font));
@@ -1211,6 +1507,7 @@ findnativefont(unsigned char* uname, integer scaled_size)
                         setReqEngine('G');
                 }
 
+                fontloadphase(FONT_PHASE_FEATURES);
                 rval = loadOTfont(0, font, scaled_size, featString);
                 if (rval == NULL)
                     deleteFont(font);
@@ -1224,9 +1521,25 @@ findnativefont(unsigned char* uname, integer scaled_size)
             }
         }
     } else {
+        ++fontsFoundByName;
         fontRef = findFontByName(nameString, varString, Fix2D(scaled_size));
 
         if (fontRef != 0) {
+#ifdef XETEX_MAC
+            char source[32];
+            sprintf(source, "%p", (void*) fontRef);
+            loadedfontalias = find_loaded_native_font(native_font_key(source, 0, scaled_size, varString, featString));
+#else
+            FcChar8* path;
+            int faceIndex = 0;
+            if (FcPatternGetString(fontRef, FC_FILE, 0, &path) == FcResultMatch) {
+                FcPatternGetInteger(fontRef, FC_INDEX, 0, &faceIndex);
+                loadedfontalias = find_loaded_native_font(native_font_key((const char*) path, faceIndex, scaled_size, varString, featString));
+            }
+#endif
+        }
+
+        if (fontRef != 0 && loadedfontalias == 0) {
             /* update nameoffile to the full name of the font, for error messages during font loading */
             const char* fullName = getFullName(fontRef);
             namelength = strlen(fullName);
@@ -1240,18 +1553,17 @@ findnativefont(unsigned char* uname, integer scaled_size)
             strcpy((char*)nameoffile + 1, fullName);
 
             if (scaled_size < 0) {
-                font = createFont(fontRef, scaled_size);
-                if (font != NULL) {
-                    Fixed dsize = D2Fix(getDesignSize(font));
-                    if (scaled_size == -1000)
-                        scaled_size = dsize;
-                    else
-                        scaled_size = zxnoverd(dsize, -scaled_size, 1000);
-                    deleteFont(font);
-                }
+                /* findFontByName has set the design size from the font's record */
+                Fixed dsize = loadedfontdesignsize;
+                if (scaled_size == -1000)
+                    scaled_size = dsize;
+                else
+                    scaled_size = zxnoverd(dsize, -scaled_size, 1000);
             }
 
+            fontloadphase(FONT_PHASE_OPEN);
             font = createFont(fontRef, scaled_size);
+            fontloadphase(FONT_PHASE_FEATURES);
             if (font != NULL) {
 #ifdef XETEX_MAC
                 /* decide whether to use AAT or OpenType rendering with this font */
@@ -1299,9 +1611,46 @@ findnativefont(unsigned char* uname, integer scaled_size)
 
     free(nameString);
 
+    /* the rest is done by load_native_font */
+    fontloadphase(FONT_PHASE_METRICS);
+
     return rval;
 }
 
+void
+preloadnativefonts(const unsigned char* name)
+{
+    /* |name| is the job's font list, in the output directory */
+    char* path;
+    if (output_directory && !kpse_absolute_p((const char*) name, false))
+        path = concat3(output_directory, DIR_SEP_STRING, (const char*) name);
+    else
+        path = xstrdup((const char*) name);
+    preloadFontFaces(path);
+    free(path);
+}
+
+FILE*
+open_font_list_file(const char* path, int forOutput)
+{
+    /* the job's font list, read and written by XeTeXFontFace */
+    FILE* f;
+    if (forOutput) {
+        if (!kpse_out_name_ok(path))
+            return NULL;
+        f = fopen(path, FOPEN_W_MODE);
+        if (f != NULL)
+            recorder_record_output(path);
+    } else {
+        if (!kpse_in_name_ok(path))
+            return NULL;
+        f = fopen(path, FOPEN_R_MODE);
+        if (f != NULL)
+            recorder_record_input(path);
+    }
+    return f;
+}
+
 void
 releasefontengine(void* engine, int type_flag)
 {
@@ -1929,6 +2278,8 @@ get_native_glyph(void* pNode, unsigned index)
         return glyphIDs[index];
 }
 
+static void shape_native_node(memoryword* node, int use_glyph_metrics, int cacheable);
+
 void
 store_justified_native_glyphs(void* pNode)
 {
@@ -1945,7 +2296,9 @@ store_justified_native_glyphs(void* pNode)
     /* save desired width */
     int savedWidth = node_width(node);
 
-    measure_native_node(node, 0);
+    /* a whole line (or run of merged words) is hardly ever seen again,
+       so it would only push real words out of the cache */
+    shape_native_node(node, 0, 0);
 
     if (node_width(node) != savedWidth) {
         /* see how much adjustment is needed overall */
@@ -1981,161 +2334,218 @@ store_justified_native_glyphs(void* pNode)
     }
 }
 
-void
-measure_native_node(void* pNode, int use_glyph_metrics)
-{
-    memoryword* node = (memoryword*)pNode;
-    int txtLen = native_length(node);
-    uint16_t* txtPtr = (uint16_t*)(node + native_node_size);
+/* Remembered inline formulas
 
-    unsigned f = native_font(node);
+   With xetex_math_memo set in texmf.cnf or the environment, after_math keeps
+   the hlists made from simple inline formulas in |math_memo_list|, so that the
+   same formula can be copied rather than converted again. The keys are kept
+   here: for each formula, the numbers that after_math gave addmathmemokey
+   (its noads and the fonts and parameters mlist_to_hlist would use), and the
+   generation they belong to, which changes whenever a \fontdimen is set. */
 
-#ifdef XETEX_MAC
-    if (fontarea[f] == AAT_FONT_FLAG) {
-        /* we're using this font in AAT mode, so fontlayoutengine[f] is actually a CFDictionaryRef */
-        DoAATLayout(node, 0);
-    } else
-#endif
-    if (fontarea[f] == OTGR_FONT_FLAG) {
-        /* using this font in OT Layout mode, so fontlayoutengine[f] is actually a XeTeXLayoutEngine */
+typedef struct mathmemo {
+    integer* key;
+    int len;
+    long generation;
+} mathmemo;
 
-        XeTeXLayoutEngine engine = (XeTeXLayoutEngine)(fontlayoutengine[f]);
+static mathmemo* mathMemos = NULL;
+static integer* mathMemoKey = NULL;
+static int mathMemoKeyLen = 0;
+static int mathMemoKeySize = 0;
+static long mathMemoGeneration = 0;
+static long mathMemoHits = 0;
+static long mathMemoMisses = 0;
 
-        FixedPoint* locations = NULL;
-        uint16_t* glyphIDs;
-        Fixed* glyphAdvances = NULL;
-        int totalGlyphCount = 0;
+int
+mathmemoenabled(void)
+{
+    static int memo = -1;
+    if (memo < 0) {
+        char* v = kpse_var_value("xetex_math_memo");
+        memo = v && (*v == 't' || *v == 'y' || *v == '1');
+        free(v);
+    }
+    return memo;
+}
 
-        /* need to find direction runs within the text, and call layoutChars separately for each */
+void
+beginmathmemokey(void)
+{
+    mathMemoKeyLen = 0;
+}
 
-        UBiDiDirection dir;
-        void* glyph_info = 0;
-        static FloatPoint* positions = 0;
-        static float* advances = 0;
-        static uint32_t* glyphs = 0;
+void
+addmathmemokey(integer n)
+{
+    if (mathMemoKeyLen == mathMemoKeySize) {
+        mathMemoKeySize += 64;
+        mathMemoKey = (integer*) xrealloc(mathMemoKey, mathMemoKeySize * sizeof(integer));
+    }
+    mathMemoKey[mathMemoKeyLen++] = n;
+}
 
-        UBiDi* pBiDi = ubidi_open();
+integer
+findmathmemo(integer size)
+{
+    /* returns the slot of the formula whose key has just been given if it is
+       there, or else -2 minus the slot it should go into (and takes the slot
+       for it, assuming that after_math will put it there) */
+    unsigned int h = 2166136261U ^ (unsigned int) mathMemoGeneration;
+    mathmemo* m;
+    int i;
 
-        UErrorCode errorCode = U_ZERO_ERROR;
-        ubidi_setPara(pBiDi, (const UChar*) txtPtr, txtLen, getDefaultDirection(engine), NULL, &errorCode);
+    if (mathMemos == NULL)
+        mathMemos = (mathmemo*) xcalloc(size, sizeof(mathmemo));
 
-        dir = ubidi_getDirection(pBiDi);
-        if (dir == UBIDI_MIXED) {
-            /* we actually do the layout twice here, once to count glyphs and then again to get them;
-               which is inefficient, but i figure that MIXED is a relatively rare occurrence, so i can't be
-               bothered to deal with the memory reallocation headache of doing it differently
-            */
-            int nRuns = ubidi_countRuns(pBiDi, &errorCode);
-            double width = 0;
-            int i, runIndex;
-            int32_t logicalStart, length;
-            for (runIndex = 0; runIndex < nRuns; ++runIndex) {
-                dir = ubidi_getVisualRun(pBiDi, runIndex, &logicalStart, &length);
-                totalGlyphCount += layoutChars(engine, txtPtr, logicalStart, length, txtLen, (dir == UBIDI_RTL));
-            }
+    for (i = 0; i < mathMemoKeyLen; ++i)
+        h = (h ^ (unsigned int) mathMemoKey[i]) * 16777619U;
+    m = &mathMemos[h % size];
 
-            if (totalGlyphCount > 0) {
-                double x, y;
-                glyph_info = xcalloc(totalGlyphCount, native_glyph_info_size);
-                locations = (FixedPoint*)glyph_info;
-                glyphIDs = (uint16_t*)(locations + totalGlyphCount);
-                glyphAdvances = (Fixed*) xcalloc(totalGlyphCount, sizeof(Fixed));
-                totalGlyphCount = 0;
-
-                x = y = 0.0;
-                for (runIndex = 0; runIndex < nRuns; ++runIndex) {
-                    int nGlyphs;
-                    dir = ubidi_getVisualRun(pBiDi, runIndex, &logicalStart, &length);
-                    nGlyphs = layoutChars(engine, txtPtr, logicalStart, length, txtLen,
-                                            (dir == UBIDI_RTL));
-
-                    glyphs = (uint32_t*) xcalloc(nGlyphs, sizeof(uint32_t));
-                    positions = (FloatPoint*) xcalloc(nGlyphs + 1, sizeof(FloatPoint));
-                    advances = (float*) xcalloc(nGlyphs, sizeof(float));
-
-                    getGlyphs(engine, glyphs);
-                    getGlyphAdvances(engine, advances);
-                    getGlyphPositions(engine, positions);
-
-                    for (i = 0; i < nGlyphs; ++i) {
-                        glyphIDs[totalGlyphCount] = glyphs[i];
-                        locations[totalGlyphCount].x = D2Fix(positions[i].x + x);
-                        locations[totalGlyphCount].y = D2Fix(positions[i].y + y);
-                        glyphAdvances[totalGlyphCount] = D2Fix(advances[i]);
-                        ++totalGlyphCount;
-                    }
-                    x += positions[nGlyphs].x;
-                    y += positions[nGlyphs].y;
+    if (m->key != NULL && m->generation == mathMemoGeneration && m->len == mathMemoKeyLen
+            && memcmp(m->key, mathMemoKey, mathMemoKeyLen * sizeof(integer)) == 0) {
+        ++mathMemoHits;
+        return m - mathMemos;
+    }
 
-                    free(glyphs);
-                    free(positions);
-                    free(advances);
-                }
-                width = x;
-            }
+    ++mathMemoMisses;
+    m->key = (integer*) xrealloc(m->key, mathMemoKeyLen * sizeof(integer));
+    memcpy(m->key, mathMemoKey, mathMemoKeyLen * sizeof(integer));
+    m->len = mathMemoKeyLen;
+    m->generation = mathMemoGeneration;
+    return -2 - (m - mathMemos);
+}
 
-            node_width(node) = D2Fix(width);
-            native_glyph_count(node) = totalGlyphCount;
-            native_glyph_info_ptr(node) = glyph_info;
-        } else {
-            double width = 0;
-            totalGlyphCount = layoutChars(engine, txtPtr, 0, txtLen, txtLen, (dir == UBIDI_RTL));
+void
+newmathmemogeneration(void)
+{
+    ++mathMemoGeneration;
+}
 
-            glyphs = (uint32_t*) xcalloc(totalGlyphCount, sizeof(uint32_t));
-            positions = (FloatPoint*) xcalloc(totalGlyphCount + 1, sizeof(FloatPoint));
-            advances = (float*) xcalloc(totalGlyphCount, sizeof(float));
+/* counters reported in the log by reportnativefontstats() */
+static long shapedWordCacheHits = 0;
+static long shapedWordCacheMisses = 0;
+static long batchedWords = 0;
+static long shapingBatches = 0;
+static long concatenatedRuns = 0;
 
-            getGlyphs(engine, glyphs);
-            getGlyphAdvances(engine, advances);
-            getGlyphPositions(engine, positions);
+void
+reportnativefontstats(void)
+{
+    long preloaded, preloadsUsed;
+
+    if (shapedWordCacheHits + shapedWordCacheMisses > 0)
+        fprintf(logfile, " %ld shaped-word cache hits, %ld misses\n",
+                shapedWordCacheHits, shapedWordCacheMisses);
+    if (shapingBatches > 0)
+        fprintf(logfile, " %ld words shaped in %ld batches\n",
+                batchedWords, shapingBatches);
+    if (concatenatedRuns > 0)
+        fprintf(logfile, " %ld merged word runs built without reshaping\n",
+                concatenatedRuns);
+    if (brkItersOpened > 0)
+        fprintf(logfile, " %ld line break iterators opened\n",
+                brkItersOpened);
+    if (fontsShared > 0)
+        fprintf(logfile, " %ld native font requests satisfied by fonts already loaded\n",
+                fontsShared);
+    if (mathMemoHits + mathMemoMisses > 0)
+        fprintf(logfile, " %ld inline formulas reused, %ld converted and remembered\n",
+                mathMemoHits, mathMemoMisses);
+    getFontPreloadStats(&preloaded, &preloadsUsed);
+    if (preloaded > 0)
+        fprintf(logfile, " %ld of %ld preloaded font files used\n",
+                preloadsUsed, preloaded);
+    if (fontsFoundByName + fontsFoundByFile > 0)
+        fprintf(logfile, " %ld native font lookups by name, %ld by file name (%s %s)\n",
+                fontsFoundByName, fontsFoundByFile,
+#ifdef XETEX_MAC
+                "system font list",
+#else
+                "fontconfig",
+#endif
+                fontManagerStarted() ? "started" : "not started");
+}
 
-            if (totalGlyphCount > 0) {
-                int i;
-                glyph_info = xcalloc(totalGlyphCount, native_glyph_info_size);
-                locations = (FixedPoint*)glyph_info;
-                glyphIDs = (uint16_t*)(locations + totalGlyphCount);
-                glyphAdvances = (Fixed*) xcalloc(totalGlyphCount, sizeof(Fixed));
-                for (i = 0; i < totalGlyphCount; ++i) {
-                    glyphIDs[i] = glyphs[i];
-                    glyphAdvances[i] = D2Fix(advances[i]);
-                    locations[i].x = D2Fix(positions[i].x);
-                    locations[i].y = D2Fix(positions[i].y);
-                }
-                width = positions[totalGlyphCount].x;
-            }
+/* Measuring a word needs a bidi object and room for the glyph advances (which
+   are only used for letterspacing); both are kept from one word to the next,
+   so that the node's glyph_info is the only allocation made for it. */
 
-            node_width(node) = D2Fix(width);
-            native_glyph_count(node) = totalGlyphCount;
-            native_glyph_info_ptr(node) = glyph_info;
+static UBiDi*
+shared_bidi(void)
+{
+    static UBiDi* pBiDi = NULL;
+    if (pBiDi == NULL)
+        pBiDi = ubidi_open();
+    return pBiDi;
+}
 
-            free(glyphs);
-            free(positions);
-            free(advances);
-        }
+static Fixed* scratchAdvances = NULL;
+static int scratchAdvancesSize = 0;
 
-        ubidi_close(pBiDi);
+static Fixed*
+scratch_advances(int glyphCount)
+{
+    if (glyphCount + 1 > scratchAdvancesSize) {
+        scratchAdvancesSize = glyphCount + 1 + scratchAdvancesSize / 2;
+        scratchAdvances = (Fixed*) xrealloc(scratchAdvances, scratchAdvancesSize * sizeof(Fixed));
+    }
+    return scratchAdvances;
+}
 
+static void
+store_cached_native_glyphs(memoryword* node, const ShapedWord* word)
+{
+    void* glyph_info = 0;
 
-        if (fontletterspace[f] != 0) {
-            Fixed lsDelta = 0;
-            Fixed lsUnit = fontletterspace[f];
-            int i;
-            for (i = 0; i < totalGlyphCount; ++i) {
-                if (glyphAdvances[i] == 0 && lsDelta != 0)
-                    lsDelta -= lsUnit;
-                locations[i].x += lsDelta;
-                lsDelta += lsUnit;
-            }
-            if (lsDelta != 0) {
+    if (word->glyphCount > 0) {
+        glyph_info = xmalloc(word->glyphCount * native_glyph_info_size);
+        memcpy(glyph_info, word->glyphInfo, word->glyphCount * native_glyph_info_size);
+    }
+    node_width(node) = word->width;
+    native_glyph_count(node) = word->glyphCount;
+    native_glyph_info_ptr(node) = glyph_info;
+}
+
+static void
+cache_native_glyphs(XeTeXLayoutEngine engine, memoryword* node, int baseDirection, const Fixed* glyphAdvances, uint32_t script)
+{
+    ShapedWord word;
+    word.glyphCount = native_glyph_count(node);
+    word.width = node_width(node);
+    word.glyphInfo = native_glyph_info_ptr(node);
+    word.glyphAdvances = glyphAdvances;
+    word.script = script;
+    cacheShapedWord(engine, (uint16_t*)(node + native_node_size), native_length(node), baseDirection, &word);
+}
+
+static void
+apply_letterspacing(memoryword* node, const Fixed* glyphAdvances)
+{
+    unsigned f = native_font(node);
+
+    if (fontletterspace[f] != 0) {
+        FixedPoint* locations = (FixedPoint*)native_glyph_info_ptr(node);
+        Fixed lsDelta = 0;
+        Fixed lsUnit = fontletterspace[f];
+        int i;
+        for (i = 0; i < native_glyph_count(node); ++i) {
+            if (glyphAdvances[i] == 0 && lsDelta != 0)
                 lsDelta -= lsUnit;
-                node_width(node) += lsDelta;
-            }
+            locations[i].x += lsDelta;
+            lsDelta += lsUnit;
+        }
+        if (lsDelta != 0) {
+            lsDelta -= lsUnit;
+            node_width(node) += lsDelta;
         }
-        free(glyphAdvances);
-    } else {
-        fprintf(stderr, "\n! Internal error: bad native font flag in `measure_native_node'\n");
-        exit(3);
     }
+}
+
+static void
+set_native_height_depth(memoryword* node, int use_glyph_metrics)
+{
+    unsigned f = native_font(node);
 
     if (use_glyph_metrics == 0 || native_glyph_count(node) == 0) {
         /* for efficiency, height and depth are the font's ascent/descent,
@@ -2155,17 +2565,16 @@ measure_native_node(void* pNode, int use_glyph_metrics)
             float y = Fix2D(-locations[i].y); /* NB negative is upwards in locations[].y! */
 
             GlyphBBox bbox;
-            if (getCachedGlyphBBox(f, glyphIDs[i], &bbox) == 0) {
 #ifdef XETEX_MAC
-                if (fontarea[f] == AAT_FONT_FLAG)
+            if (fontarea[f] == AAT_FONT_FLAG) {
+                if (getCachedGlyphBBox(f, glyphIDs[i], &bbox) == 0) {
                     GetGlyphBBox_AAT((CFDictionaryRef)(fontlayoutengine[f]), glyphIDs[i], &bbox);
-                else
+                    cacheGlyphBBox(f, glyphIDs[i], &bbox);
+                }
+            } else
 #endif
-                if (fontarea[f] == OTGR_FONT_FLAG)
-                    getGlyphBounds((XeTeXLayoutEngine)(fontlayoutengine[f]), glyphIDs[i], &bbox);
-
-                cacheGlyphBBox(f, glyphIDs[i], &bbox);
-            }
+            /* the font instance keeps its own table of glyph metrics */
+            getGlyphBounds((XeTeXLayoutEngine)(fontlayoutengine[f]), glyphIDs[i], &bbox);
 
             ht = bbox.yMax;
             dp = -bbox.yMin;
@@ -2180,6 +2589,324 @@ measure_native_node(void* pNode, int use_glyph_metrics)
     }
 }
 
+void
+measure_native_node(void* pNode, int use_glyph_metrics)
+{
+    shape_native_node((memoryword*)pNode, use_glyph_metrics, 1);
+}
+
+static void
+shape_native_node(memoryword* node, int use_glyph_metrics, int cacheable)
+{
+    int txtLen = native_length(node);
+    uint16_t* txtPtr = (uint16_t*)(node + native_node_size);
+
+    unsigned f = native_font(node);
+
+#ifdef XETEX_MAC
+    if (fontarea[f] == AAT_FONT_FLAG) {
+        /* we're using this font in AAT mode, so fontlayoutengine[f] is actually a CFDictionaryRef */
+        DoAATLayout(node, 0);
+    } else
+#endif
+    if (fontarea[f] == OTGR_FONT_FLAG) {
+        /* using this font in OT Layout mode, so fontlayoutengine[f] is actually a XeTeXLayoutEngine */
+
+        XeTeXLayoutEngine engine = (XeTeXLayoutEngine)(fontlayoutengine[f]);
+
+        FixedPoint* locations;
+        uint16_t* glyphIDs;
+        Fixed* glyphAdvances;
+        int totalGlyphCount = 0;
+        double x = 0.0, y = 0.0;
+
+        /* need to find direction runs within the text, and call layoutChars separately for each */
+
+        UBiDiDirection dir;
+        void* glyph_info = 0;
+
+        UBiDi* pBiDi = shared_bidi();
+        UErrorCode errorCode = U_ZERO_ERROR;
+        int baseDirection = getDefaultDirection(engine);
+        ShapedWord word;
+
+        if (cacheable && getCachedShapedWord(engine, txtPtr, txtLen, baseDirection, &word)) {
+            ++shapedWordCacheHits;
+            store_cached_native_glyphs(node, &word);
+            apply_letterspacing(node, word.glyphAdvances);
+            set_native_height_depth(node, use_glyph_metrics);
+            return;
+        }
+        if (cacheable)
+            ++shapedWordCacheMisses;
+
+        ubidi_setPara(pBiDi, (const UChar*) txtPtr, txtLen, baseDirection, NULL, &errorCode);
+
+        dir = ubidi_getDirection(pBiDi);
+        if (dir == UBIDI_MIXED) {
+            /* each visual run is shaped just once, and its glyphs are collected in a scratch arena
+               that grows as needed; the node's glyph_info is only built when all runs are done */
+            static FixedPoint* runLocations = 0;
+            static uint16_t* runGlyphIDs = 0;
+            static Fixed* runAdvances = 0;
+            static int arenaSize = 0;
+            int nRuns = ubidi_countRuns(pBiDi, &errorCode);
+            int runIndex;
+            int32_t logicalStart, length;
+            for (runIndex = 0; runIndex < nRuns; ++runIndex) {
+                int nGlyphs;
+                dir = ubidi_getVisualRun(pBiDi, runIndex, &logicalStart, &length);
+                nGlyphs = layoutChars(engine, txtPtr, logicalStart, length, txtLen, (dir == UBIDI_RTL));
+
+                if (totalGlyphCount + nGlyphs > arenaSize) {
+                    arenaSize = totalGlyphCount + nGlyphs + arenaSize / 2;
+                    runLocations = (FixedPoint*) xrealloc(runLocations, arenaSize * sizeof(FixedPoint));
+                    runGlyphIDs = (uint16_t*) xrealloc(runGlyphIDs, arenaSize * sizeof(uint16_t));
+                    runAdvances = (Fixed*) xrealloc(runAdvances, arenaSize * sizeof(Fixed));
+                }
+
+                getGlyphLayout(engine, runLocations + totalGlyphCount, runGlyphIDs + totalGlyphCount,
+                               runAdvances + totalGlyphCount, &x, &y);
+                totalGlyphCount += nGlyphs;
+            }
+
+            if (totalGlyphCount > 0) {
+                glyph_info = xmalloc(totalGlyphCount * native_glyph_info_size);
+                locations = (FixedPoint*)glyph_info;
+                glyphIDs = (uint16_t*)(locations + totalGlyphCount);
+                memcpy(locations, runLocations, totalGlyphCount * sizeof(FixedPoint));
+                memcpy(glyphIDs, runGlyphIDs, totalGlyphCount * sizeof(uint16_t));
+            } else
+                x = 0.0;
+            glyphAdvances = runAdvances;
+        } else {
+            /* the layout goes straight into the node's glyph_info */
+            totalGlyphCount = layoutChars(engine, txtPtr, 0, txtLen, txtLen, (dir == UBIDI_RTL));
+
+            if (totalGlyphCount > 0)
+                glyph_info = xmalloc(totalGlyphCount * native_glyph_info_size);
+            locations = (FixedPoint*)glyph_info;
+            glyphIDs = (uint16_t*)(locations + totalGlyphCount);
+            glyphAdvances = scratch_advances(totalGlyphCount);
+
+            getGlyphLayout(engine, locations, glyphIDs, glyphAdvances, &x, &y);
+            if (totalGlyphCount == 0)
+                x = 0.0;
+        }
+
+        node_width(node) = D2Fix(x);
+        native_glyph_count(node) = totalGlyphCount;
+        native_glyph_info_ptr(node) = glyph_info;
+
+        if (cacheable)
+            cache_native_glyphs(engine, node, baseDirection, glyphAdvances, getLayoutScript(engine));
+        apply_letterspacing(node, glyphAdvances);
+    } else {
+        fprintf(stderr, "\n! Internal error: bad native font flag in `measure_native_node'\n");
+        exit(3);
+    }
+
+    set_native_height_depth(node, use_glyph_metrics);
+}
+
+/* When words are shaped on several threads (see getShapingThreads), the words
+   that do_locale_linebreaks makes of a run of text are queued here rather than
+   measured one by one, and shaped together by flush_native_node_queue before
+   anything looks at their widths. Everything that depends on the order of the
+   words (the word cache, the base direction of the next word) is still done
+   here on the main thread, in order, so the results are exactly the same. */
+
+typedef struct {
+    memoryword* node;
+    int         baseDirection;
+    int         useGlyphMetrics;
+    uint32_t    script;
+} QueuedNode;
+
+static ShapingJob* shapingJobs = NULL;
+static QueuedNode* queuedNodes = NULL;
+static int queueSize = 0;
+static int queueLength = 0;
+
+void
+queue_native_node(void* pNode, int use_glyph_metrics)
+{
+    memoryword* node = (memoryword*)pNode;
+    int txtLen = native_length(node);
+    uint16_t* txtPtr = (uint16_t*)(node + native_node_size);
+    unsigned f = native_font(node);
+    XeTeXLayoutEngine engine;
+    UBiDi* pBiDi;
+    UErrorCode errorCode = U_ZERO_ERROR;
+    UBiDiDirection dir;
+    int baseDirection;
+    ShapedWord word;
+
+    if (getShapingThreads() == 0 || fontarea[f] != OTGR_FONT_FLAG
+            || !canBatchLayout((XeTeXLayoutEngine)(fontlayoutengine[f]))) {
+        measure_native_node(pNode, use_glyph_metrics);
+        return;
+    }
+
+    engine = (XeTeXLayoutEngine)(fontlayoutengine[f]);
+    baseDirection = getDefaultDirection(engine);
+    if (getCachedShapedWord(engine, txtPtr, txtLen, baseDirection, &word)) {
+        /* as in measure_native_node; the lookup has already set the engine's script */
+        ++shapedWordCacheHits;
+        store_cached_native_glyphs(node, &word);
+        apply_letterspacing(node, word.glyphAdvances);
+        set_native_height_depth(node, use_glyph_metrics);
+        return;
+    }
+
+    pBiDi = shared_bidi();
+    ubidi_setPara(pBiDi, (const UChar*) txtPtr, txtLen, baseDirection, NULL, &errorCode);
+    dir = ubidi_getDirection(pBiDi);
+    if (dir == UBIDI_MIXED) {
+        measure_native_node(pNode, use_glyph_metrics);
+        return;
+    }
+
+    ++shapedWordCacheMisses;
+
+    if (queueLength == queueSize) {
+        queueSize = queueSize + 64 + queueSize / 2;
+        shapingJobs = (ShapingJob*) xrealloc(shapingJobs, queueSize * sizeof(ShapingJob));
+        queuedNodes = (QueuedNode*) xrealloc(queuedNodes, queueSize * sizeof(QueuedNode));
+    }
+
+    shapingJobs[queueLength].engine = engine;
+    shapingJobs[queueLength].chars = txtPtr;
+    shapingJobs[queueLength].count = txtLen;
+    shapingJobs[queueLength].rightToLeft = (dir == UBIDI_RTL);
+    queuedNodes[queueLength].node = node;
+    queuedNodes[queueLength].baseDirection = baseDirection;
+    queuedNodes[queueLength].useGlyphMetrics = use_glyph_metrics;
+
+    /* the next word's base direction depends on the script of this one */
+    prepareLayoutChars(engine, txtPtr, txtLen, (dir == UBIDI_RTL));
+    queuedNodes[queueLength].script = getLayoutScript(engine);
+
+    ++queueLength;
+}
+
+void
+flush_native_node_queue(void)
+{
+    int i;
+
+    if (queueLength == 0)
+        return;
+
+    layoutCharsBatch(shapingJobs, queueLength);
+    ++shapingBatches;
+    batchedWords += queueLength;
+
+    for (i = 0; i < queueLength; ++i) {
+        ShapingJob* job = &shapingJobs[i];
+        QueuedNode* queued = &queuedNodes[i];
+
+        node_width(queued->node) = job->width;
+        native_glyph_count(queued->node) = job->glyphCount;
+        native_glyph_info_ptr(queued->node) = job->glyphInfo;
+
+        cache_native_glyphs(job->engine, queued->node, queued->baseDirection, job->advances, queued->script);
+        apply_letterspacing(queued->node, job->advances);
+        free(job->advances);
+        set_native_height_depth(queued->node, queued->useGlyphMetrics);
+    }
+
+    queueLength = 0;
+}
+
+/* With \XeTeXinterwordspaceshaping=3, hlist_out builds the node for a run of
+   words and spaces from the glyphs the words already have, as long as
+   canmergenativeglyphs says the font can't do anything across the spaces;
+   otherwise (and for text that isn't plain left-to-right) the merged node is
+   shaped again as a whole, as with \XeTeXinterwordspaceshaping=2. */
+
+static FixedPoint* mergeLocations = NULL;
+static uint16_t* mergeGlyphIDs = NULL;
+static int mergeSize = 0;
+static int mergeCount = 0;
+
+int
+canmergenativeglyphs(integer f)
+{
+    return fontarea[f] == OTGR_FONT_FLAG
+        && canMergeShapedWords((XeTeXLayoutEngine)(fontlayoutengine[f]));
+}
+
+void
+beginnativeglyphmerge(void)
+{
+    mergeCount = 0;
+}
+
+static void
+append_merged_glyph(uint16_t gid, Fixed x, Fixed y)
+{
+    if (mergeCount == mergeSize) {
+        mergeSize = mergeSize + 256 + mergeSize / 2;
+        mergeLocations = (FixedPoint*) xrealloc(mergeLocations, mergeSize * sizeof(FixedPoint));
+        mergeGlyphIDs = (uint16_t*) xrealloc(mergeGlyphIDs, mergeSize * sizeof(uint16_t));
+    }
+    mergeLocations[mergeCount].x = x;
+    mergeLocations[mergeCount].y = y;
+    mergeGlyphIDs[mergeCount] = gid;
+    ++mergeCount;
+}
+
+void
+merge_native_word_glyphs(void* pNode, integer x)
+{
+    memoryword* node = (memoryword*)pNode;
+    FixedPoint* locations = (FixedPoint*)native_glyph_info_ptr(node);
+    uint16_t* glyphIDs = (uint16_t*)(locations + native_glyph_count(node));
+    int i;
+
+    for (i = 0; i < native_glyph_count(node); ++i)
+        append_merged_glyph(glyphIDs[i], locations[i].x + x, locations[i].y);
+}
+
+void
+mergespaceglyph(integer f, integer x)
+{
+    append_merged_glyph(mapchartoglyph(f, ' '), x, 0);
+}
+
+int
+end_native_glyph_merge(void* pNode)
+{
+    memoryword* node = (memoryword*)pNode;
+    int txtLen = native_length(node);
+    uint16_t* txtPtr = (uint16_t*)(node + native_node_size);
+    XeTeXLayoutEngine engine = (XeTeXLayoutEngine)(fontlayoutengine[native_font(node)]);
+    UBiDi* pBiDi;
+    UErrorCode errorCode = U_ZERO_ERROR;
+    UBiDiDirection dir;
+    void* glyph_info;
+
+    if (mergeCount == 0 || mergeCount > 0xFFFF)
+        return false;
+
+    pBiDi = shared_bidi();
+    ubidi_setPara(pBiDi, (const UChar*) txtPtr, txtLen, getDefaultDirection(engine), NULL, &errorCode);
+    dir = ubidi_getDirection(pBiDi);
+    if (dir != UBIDI_LTR)
+        return false;
+
+    glyph_info = xmalloc(mergeCount * native_glyph_info_size);
+    memcpy(glyph_info, mergeLocations, mergeCount * sizeof(FixedPoint));
+    memcpy((FixedPoint*)glyph_info + mergeCount, mergeGlyphIDs, mergeCount * sizeof(uint16_t));
+    native_glyph_count(node) = mergeCount;
+    native_glyph_info_ptr(node) = glyph_info;
+    set_native_height_depth(node, 0);
+
+    ++concatenatedRuns;
+    return true;
+}
+
 Fixed
 get_native_italic_correction(void* pNode)
 {
@@ -47,6 +47,17 @@ typedef struct UFILE* unicodefile;
 #define FONT_FLAGS_COLORED  0x01
 #define FONT_FLAGS_VERTICAL 0x02
 
+/* the phases of loading a native font, timed when \XeTeXtracingfonts >= 3 */
+#define FONT_PHASE_LOOKUP   0 /* finding the font by name (fontconfig etc.) or file */
+#define FONT_PHASE_NAMES    1 /* reading the name tables of fonts that might match */
+#define FONT_PHASE_OPEN     2 /* opening the file with FreeType */
+#define FONT_PHASE_HB_FACE  3 /* making the HarfBuzz face */
+#define FONT_PHASE_FEATURES 4 /* reading the feature string */
+#define FONT_PHASE_MAPPING  5 /* loading the TECkit mapping */
+#define FONT_PHASE_METRICS  6 /* setting up the TeX font (in load_native_font) */
+#define FONT_PHASE_MATH     7 /* reading the OpenType MATH constants */
+#define FONT_PHASE_COUNT    8
+
 /* some typedefs that XeTeX uses - on Mac OS, we get these from Apple headers,
    but otherwise we'll need these substitute definitions */
 
@@ -203,6 +214,18 @@ extern "C" {
     void printchars(const unsigned short* str, int len);
     void* findnativefont(unsigned char* name, integer scaled_size);
     void releasefontengine(void* engine, int type_flag);
+    void remembernativefont(integer f);
+    void preloadnativefonts(const unsigned char* name);
+    FILE* open_font_list_file(const char* path, int forOutput);
+    int fontloadphase(int phase);
+    void startfontmathtiming(void);
+    void finishfontloadtiming(integer f);
+    void reportfontloadtimes(void);
+    int mathmemoenabled(void);
+    void beginmathmemokey(void);
+    void addmathmemokey(integer n);
+    integer findmathmemo(integer size);
+    void newmathmemogeneration(void);
     int readCommonFeatures(const char* feat, const char* end, float* extend, float* slant, float* embolden, float* letterspace, uint32_t* rgbValue);
 
     /* the metrics params here are really TeX 'scaled' values, but that typedef isn't available every place this is included */
@@ -227,6 +250,14 @@ extern "C" {
     int applymapping(void* cnv, uint16_t* txtPtr, int txtLen);
     void store_justified_native_glyphs(void* node);
     void measure_native_node(void* node, int use_glyph_metrics);
+    void queue_native_node(void* node, int use_glyph_metrics);
+    void flush_native_node_queue(void);
+    int canmergenativeglyphs(integer f);
+    void beginnativeglyphmerge(void);
+    void merge_native_word_glyphs(void* node, integer x);
+    void mergespaceglyph(integer f, integer x);
+    int end_native_glyph_merge(void* node);
+    void reportnativefontstats(void);
     Fixed get_native_italic_correction(void* node);
     Fixed get_native_glyph_italic_correction(void* node);
     integer get_native_word_cp(void* node, int side);
@@ -45,10 +45,14 @@ authorization from the copyright holders.
 
 /* p is native_word node; g is XeTeX_use_glyph_metrics flag */
 #define setnativemetrics(p,g)                   measure_native_node(&(mem[p]), g)
+#define queuenativemetrics(p,g)                 queue_native_node(&(mem[p]), g)
+#define flushnativemetrics()                    flush_native_node_queue()
 
 #define setnativeglyphmetrics(p,g)              measure_native_glyph(&(mem[p]), g)
 
 #define setjustifiednativeglyphs(p)             store_justified_native_glyphs(&(mem[p]))
+#define mergenativewordglyphs(p,x)              merge_native_word_glyphs(&(mem[p]), x)
+#define endnativeglyphmerge(p)                  end_native_glyph_merge(&(mem[p]))
 
 #define getnativeitaliccorrection(p)            get_native_italic_correction(&(mem[p]))
 #define getnativeglyphitaliccorrection(p)       get_native_glyph_italic_correction(&(mem[p]))
@@ -90,6 +94,7 @@ authorization from the copyright holders.
 #define getnativemathexparam                    get_native_mathex_param
 #define getotmathconstant                       get_ot_math_constant
 #define getotmathvariant                        get_ot_math_variant
+#define getotmathvariantforsize                 get_ot_math_variant_for_size
 #define getotassemblyptr                        get_ot_assembly_ptr
 #define freeotassembly                          free_ot_assembly
 #define getotmathitalcorr                       get_ot_math_ital_corr